@@ -1,10 +1,21 @@
 #include <ao/ao.h>
 #include <mpg123.h>
 #include <set>
+#include <queue>
 #include <iostream>
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <cstring>
+#include <cctype>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <algorithm>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -14,6 +25,21 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "beam_simd.h"
+#include "energy.h"
+#include "events.h"
+#include "gl_trace.h"
+#include "hud_font.h"
+#include "level.h"
+#include "scores.h"
+#include "segment_bvh.h"
+
 using namespace std;
 
 #define BITS 8
@@ -37,33 +63,100 @@ struct GLMatrices {
 
 GLuint programID;
 
+/* Startup phases for the time-to-first-frame report: each with the
+   milliseconds after process start it ran from and to, and whether it ran
+   on a background thread alongside the main one */
+const chrono::steady_clock::time_point process_start = chrono::steady_clock::now();
+
+struct StartupPhase {
+  const char *name;
+  double from, to;
+  bool background;
+};
+vector<StartupPhase> startup_phases;
+mutex startup_mutex;
+
+double startup_clock ()
+{
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - process_start).count();
+}
+
+/* Phase 'name' ran from 'from' until now */
+void startup_phase (const char *name, double from, bool background = false)
+{
+  StartupPhase P = { name, from, startup_clock(), background };
+  lock_guard<mutex> lock(startup_mutex);
+  startup_phases.push_back(P);
+}
+
+/* Every phase in the order they started, then the time to first frame */
+void print_startup (double first_frame)
+{
+  lock_guard<mutex> lock(startup_mutex);
+  vector<StartupPhase> P = startup_phases;
+  stable_sort(P.begin(), P.end(), [](const StartupPhase &a, const StartupPhase &b) { return a.from < b.from; });
+  printf("Startup (ms after start):\n");
+  for(int k = 0; k < (int)P.size(); k++)
+    printf("  %-26s %7.1f - %7.1f %7.1f%s\n", P[k].name, P[k].from, P[k].to, P[k].to - P[k].from,
+           P[k].background ? "  background" : "");
+  printf("First frame %.1f ms after start\n", first_frame);
+}
+
+/* Shader sources read ahead by a background thread while the window is
+   created; LoadShaders reads the file itself for any other */
+const char *const shader_files[] = { "Sample_GL.vert", "Sample_GL.frag", "Sample_Text.vert", "Sample_Text.frag" };
+map<string, string> preloaded_shaders;
+
+string read_shader (const char *path)
+{
+  map<string, string>::const_iterator it = preloaded_shaders.find(path);
+  if (it != preloaded_shaders.end())
+    return it->second;
+  std::string Code;
+  std::ifstream Stream(path, std::ios::in);
+  if(Stream.is_open())
+  {
+    std::string Line = "";
+    while(getline(Stream, Line))
+      Code += "\n" + Line;
+    Stream.close();
+  }
+  return Code;
+}
+
+void preload_shaders ()
+{
+  double t = startup_clock();
+  map<string, string> sources;
+  for(int k = 0; k < (int)(sizeof shader_files / sizeof *shader_files); k++)
+    sources[shader_files[k]] = read_shader(shader_files[k]);
+  preloaded_shaders.swap(sources);
+  startup_phase("shader sources", t, true);
+}
+
+/* Per-frame submission counters, reset at the start of draw() */
+int draw_calls = 0;
+long draw_vertices = 0;
+long upload_bytes = 0;   // vertex data given to glBufferData/glBufferSubData
+
+/* GL objects the helpers below create and delete (VAOs, buffers, textures,
+   programs, and the shader objects LoadShaders deletes once linked), the
+   same calls gl_trace.h counts as created and deleted */
+int gl_objects_created = 0, gl_objects_deleted = 0;
+
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
 
   // Create the shaders
   GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
   GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+  gl_objects_created += 2;
 
   // Read the Vertex Shader code from the file
-  std::string VertexShaderCode;
-  std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-  if(VertexShaderStream.is_open())
-  {
-    std::string Line = "";
-    while(getline(VertexShaderStream, Line))
-      VertexShaderCode += "\n" + Line;
-    VertexShaderStream.close();
-  }
+  std::string VertexShaderCode = read_shader(vertex_file_path);
 
   // Read the Fragment Shader code from the file
-  std::string FragmentShaderCode;
-  std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-  if(FragmentShaderStream.is_open()){
-    std::string Line = "";
-    while(getline(FragmentShaderStream, Line))
-      FragmentShaderCode += "\n" + Line;
-    FragmentShaderStream.close();
-  }
+  std::string FragmentShaderCode = read_shader(fragment_file_path);
 
   GLint Result = GL_FALSE;
   int InfoLogLength;
@@ -110,6 +203,8 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 
   glDeleteShader(VertexShaderID);
   glDeleteShader(FragmentShaderID);
+  gl_objects_deleted += 2;
+  gl_objects_created++;
 
   return ProgramID;
 }
@@ -140,6 +235,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
     glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+    gl_objects_created += 3;
 
     glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
     glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
@@ -177,7 +273,9 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    delete [] color_buffer_data;
+    return vao;
 }
 
 /* Render the VBOs handled by VAO */
@@ -201,6 +299,8 @@ void draw3DObject (struct VAO* vao)
 
     // Draw the geometry !
     glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    draw_calls++;
+    draw_vertices += vao->NumVertices;
 }
 
 /**************************
@@ -211,14 +311,29 @@ float triangle_rot_dir = 1;
 float rectangle_rot_dir = 1;
 bool rectangle_rot_status = true;
 bool triangle_rot_status = true;
-bool pressed[10000];
+bool perf_overlay = false;  // F3 shows the performance overlay
+/* Input is written by GLFW callbacks on the main thread into atomics. The
+   simulation latches it at the start of each tick (latch_input) and reads
+   only its copy, so input cannot change in the middle of a tick. */
+atomic<bool> key_down[10000];
+bool pressed[10000];  // key_down as latched for the current tick
+
+/* Session recording (--record): every change of the latched input, stamped
+   with the tick that consumed it; replay applies it before that tick */
+FILE *record_file = NULL;
+atomic<int> frame_no(0);
+int session_tick = 0;  // ticks run since the recording started
+unsigned game_seed = 1;
+int num_cannons = 1;  // --cannons; recorded since a replay needs the same
+int job_threads = 0;  // --jobs; 0: one per core
+
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 {
      // Function is called first on GLFW_PRESS.
     if (action == GLFW_RELEASE) {
-            pressed[key] = false;
+            key_down[key] = false;
             if(key == GLFW_KEY_C) {
               rectangle_rot_status = !rectangle_rot_status;
             }
@@ -228,10 +343,13 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
             }
     }
     else if (action == GLFW_PRESS) {
-          pressed[key] = true;
+          key_down[key] = true;
           if(key == GLFW_KEY_ESCAPE) {
             quit(window);
           }
+          if(key == GLFW_KEY_F3) {
+            perf_overlay = !perf_overlay;
+          }
     }
 }
 
@@ -248,9 +366,10 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
   }
 }
 
-void checkblock();
-void checkcanon();
-bool Clicked = false;
+atomic<bool> button_down(false);
+atomic<bool> click_pending(false); // press not yet latched by the simulation
+bool Clicked = false;     // button_down as latched for the current tick
+bool tick_click = false;  // a press was latched for the current tick
 /* Executed when a mouse button is pressed/released */
 void mouseButton (GLFWwindow* window, int button, int action, int mods)
 {
@@ -258,12 +377,11 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
         case GLFW_MOUSE_BUTTON_LEFT:
             if (action == GLFW_RELEASE) {
                 triangle_rot_dir *= -1;
-                Clicked =false;
+                button_down = false;
               }
             else if (action == GLFW_PRESS) {
-               Clicked = true;
-               checkblock();
-               checkcanon();
+               button_down = true;
+               click_pending = true;
             }
             break;  
         case GLFW_MOUSE_BUTTON_RIGHT:
@@ -304,59 +422,200 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 }
 
 struct Piece {
-  float x1, x2, y1, y2, trans;
+  float x1, x2, y1, y2;
   float color;
+  int wave;     // spawner wave this block came from
 }; 
 
+/* A block by slot plus the slot's generation when the handle was taken */
+struct BlockHandle {
+  int slot;
+  unsigned gen;
+};
+
+/* Falling blocks live in a growable pool: freed slots go on a free list,
+   live slots are kept in a dense list for iteration, and every (re)spawn
+   bumps the slot's generation so old handles go stale instead of pointing
+   at the next occupant. Spawn, respawn and despawn are all O(1). */
+struct BlockPool {
+  vector<Piece> cur;        // live position of each slot
+  vector<unsigned> gen;
+  vector<int> where;        // slot -> index in live, -1 when free
+  vector<int> live;         // dense list of occupied slots
+  vector<int> free_slots;
+
+  int alloc () {
+    int slot;
+    if (!free_slots.empty()) {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    else {
+      slot = cur.size();
+      cur.push_back(Piece());
+      gen.push_back(0);
+      where.push_back(-1);
+    }
+    where[slot] = live.size();
+    live.push_back(slot);
+    return slot;
+  }
+
+  void release (int slot) {
+    int pos = where[slot], last = live.back();
+    live[pos] = last;
+    where[last] = pos;
+    live.pop_back();
+    where[slot] = -1;
+    gen[slot]++;
+    free_slots.push_back(slot);
+  }
+
+  BlockHandle handle (int slot) const { return (BlockHandle){slot, gen[slot]}; }
+
+  bool valid (BlockHandle h) const {
+    return h.slot >= 0 && h.slot < (int)gen.size() && gen[h.slot] == h.gen && where[h.slot] >= 0;
+  }
+
+  int size () const { return live.size(); }
+
+  void clear () {
+    for(int n = size() - 1; n >= 0; n--)
+      release(live[n]);
+  }
+};
+
 struct Lazer {
   float x1, y1, ang, x2, y2;
 };
 
 float Score = 0;
+
+/* Gameplay events of the current tick, flushed at its end */
+EventBus events;
+long event_counts[EV_TYPES];  // this game's events by type
+
+void emit_event (int type, int color, int points, float x, float y)
+{
+  GameEvent e = { (unsigned char)type, (unsigned char)color, points, x, y, frame_no };
+  events.emit(e);
+}
+
+/* The score is the sum of the events' points */
+void score_events (const GameEvent *e, int n, void *)
+{
+  for(int k = 0; k < n; k++)
+    Score += e[k].points;
+}
+
+/* Counts per type, and the final report when the game ends */
+void report_events (const GameEvent *e, int n, void *)
+{
+  for(int k = 0; k < n; k++) {
+    event_counts[e[k].type]++;
+    if(e[k].type == EV_GAME_OVER) {
+      cout << "Game Over!" << endl;
+      cout << "Your final Score is: " << Score << endl;
+      cout << "Hits " << event_counts[EV_HIT] << ", catches " << event_counts[EV_CATCH]
+           << ", misses " << event_counts[EV_MISS] << endl;
+    }
+  }
+}
+
+const bool game_consumers = (events.subscribe(score_events), events.subscribe(report_events), true);
+
+int num_blocks = 20; // blocks spawned at the start of a game
+bool stress_mode = false;
+bool batch_blocks = true; // all blocks in one streamed draw call
 float zoom = 1, pan = 0;
 float block_trans = 0.3;
 vector<Lazer> L;
-vector<VAO *> lazer;
-VAO *battery, *battery_power, *battery_cell, *canonmid, *water, *Laz, *canonbase, *canonshooter, *baseline, *triangle, *rectangle, *basket1, *basket2, *block, *box[400], *mirror1, *mirror2, *mirror3;
-Piece Block[400], current[400];
+VAO *battery, *battery_power, *battery_cell, *canonmid, *water, *beam_batch, *canonbase, *canonshooter, *baseline, *triangle, *rectangle, *basket1, *basket2, *block, *block_quad[3], *block_batch, *mirror_batch;
+BlockPool pool;
+/* Per-tick block work is split over the job system in chunks of this many
+   live blocks; smaller games stay on one thread and in the original order */
+JobSystem jobs;
+int job_grain = 2048;
+/* Block motion as seen by the beam hit cache (see SegmentCache) */
+double total_fall = 0;          // distance every block has fallen so far
+double game_fall_start = 0;     // total_fall when this game began
+FrameTimes frame_times;         // rendered frames of this game
+vector<BlockHandle> spawn_log;  // blocks spawned since the oldest cached query
+
+/* Beam hit cache. The beam usually holds still for many ticks while the
+   pieces only fall, so a query keeps, per segment, the pieces that could
+   still reach it: boxes grown by beam_tolerance, stretched down by
+   cache_fall and up by the current speed (the recheck sweep). Until the
+   segment's ends move more than the tolerance, the pieces fall more than
+   cache_fall or speed up, only those candidates and pieces spawned since
+   are tested. Entries are matched by geometry, not index, because
+   LazerWithMirror shortens a segment after its first test. */
+struct SegmentCache {
+  Lazer seg;
+  double fall_mark;      // total_fall at the query
+  float speed;           // fall per tick the candidates cover
+  size_t spawn_mark;     // spawn_log entries already taken in
+  unsigned used;         // for least-recently-used replacement
+  vector<BlockHandle> candidates;
+};
+
+vector<SegmentCache> seg_cache;
+bool beam_cache = true;
+float beam_tolerance = 0.5, cache_fall = 20;
+float pass_sweep = 0;    // upward sweep of the pieces in the current pass
+unsigned cache_clock = 0;
+long cache_queries = 0, cache_reuses = 0;
+const int max_cached_segments = 8;
+
+void invalidate_beam_cache() {
+  seg_cache.clear();
+  spawn_log.clear();
+}
+
 float b1 = 0, b2 = 0;
-float c = 0;
-float rot = 0;
-bool Shoot = false;
+float scored_b1 = 0, scored_b2 = 0; // basket positions at the previous water/basket scan
 float xi;
 float yi;
-float tempx, tempy;
 float Pix = -36.5, Piy = 36.5;
-float Pfy = 33.5, Pfx = Pix;
-void createNewLazer(double x,double y,double ang,double x1=-800.0f,double y1=-800.0f) {
-
-  float slope = tan(ang);
-  if(x1==-800.0f && y1==-800.0f)
-    {
-      x1=1000.0000f;
-      if(slope>0.00001f)
-      y1=slope*1000.0000f+(y-slope*x);
-      else
-      {
-        y1=-slope*1000.00000f+(y-slope*x);
-        x1*=-1.0f;
-      }
-      tempx = x1;
-      tempy = y1;
-    }
+float Pfy = 33.5;
+
+/* Cannons on the left wall, each with its own battery and beam. Cannon 0
+   is player one (keys and mouse), 1 player two, the rest aim on their
+   own (see control_cannons). The old single-cannon names stay as cannon
+   0's fields. */
+struct Cannon {
+  float y, rot;
+  Battery battery;
+  bool firing;
+};
 
-  GLfloat vertex_buffer_data [] = {
-    x, y, 0,
-    x1, y1, 0
-  };
+const int max_cannons = 64;
+Cannon cannons[max_cannons];
+float &c = cannons[0].y, &rot = cannons[0].rot;
+bool &Shoot = cannons[0].firing;
+double battery_due = battery_never;  // earliest gauge event of any cannon
 
-  const GLfloat color_buffer_data [] = {
-    0,0,1, // color 1
-    0,0,1 // color 2
-  };
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  Laz= create3DObject(GL_LINES, 2, vertex_buffer_data, color_buffer_data, GL_LINE); 
+void schedule_batteries ()
+{
+  battery_due = battery_never;
+  for(int k = 0; k < num_cannons; k++)
+    battery_due = min(battery_due, cannons[k].battery.next);
+}
+
+bool any_firing ()
+{
+  for(int k = 0; k < num_cannons; k++)
+    if (cannons[k].firing)
+      return true;
+  return false;
+}
+
+/* Beam segments are streamed from the render snapshot every frame */
+void createBeamBatch ()
+{
+  beam_batch = create3DObject(GL_LINES, 0, NULL, (const GLfloat*)NULL, GL_LINE);
 }
+
 void createBattery ()
 {
   // GL3 accepts only Triangles. Quads are not supported 
@@ -406,13 +665,15 @@ void createBattery ()
   // create3DObject creates and returns a handle to a VAO that can be used later
   battery_cell = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data2, color_buffer_data2, GL_FILL);
 
+  // Full charge; draw() scales it down to the current level
+  const float Pmax = -32.5;
     // GL3 accepts only Triangles. Quads are not supported 
   const GLfloat vertex_buffer_data3 [] = {
     Pix, Piy, 0,
-    Pfx, Piy, 0,
-    Pfx, Pfy, 0,
+    Pmax, Piy, 0,
+    Pmax, Pfy, 0,
 
-    Pfx, Pfy, 0,
+    Pmax, Pfy, 0,
     Pix, Pfy, 0, 
     Pix, Piy, 0,
    };
@@ -431,128 +692,44 @@ void createBattery ()
 
 }
 
-void createLazer ()
+/* The level in play: the built-in board unless --level names a file.
+   Only the simulation reads it; reload_level() swaps between the two
+   files so the old one stays loaded until the new one is in. */
+const Level* builtin_level ()
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  float x2 = 500;
-  float x1 = -40;
-  float y1 = c;
-  float y2 = 540*tan(rot) + c;
+  static vector<char> buf;
+  if (buf.empty()) {
+    vector<LevelMirror> mirrors;
+    Level l = default_level(mirrors);
+    pack_level(l, &mirrors[0], buf);
+  }
+  return (const Level*)&buf[0];
+}
 
-  const GLfloat vertex_buffer_data1 [] = {
-    x1, y1, 0,   // vertex 1
-    x2, y2, 0  // vertex 2
-   };
+const Level *level = builtin_level();
+LevelFile level_file[2];
+int level_slot = 0;
+const char *level_path = NULL;
+LevelWatch level_watch;
 
-  const GLfloat color_buffer_data1 [] = {
-    0,0,1,  //color 1
-    0,0,1,  //color 2
-  };
+/* Mirrors of the level for the beam (BVH over their edges) and, shared
+   with the render snapshots, for drawing */
+SegmentBVH mirror_bvh;
+shared_ptr<const vector<LevelMirror> > mirror_art;
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  Laz = create3DObject(GL_LINES, 2, vertex_buffer_data1, color_buffer_data1, GL_LINE);
+/* Built once per level load; needs no GL */
+void createMirrorGeometry ()
+{
+  const LevelMirror *M = level_mirrors(level);
+  mirror_bvh.build(M, level->mirrors);
+  mirror_art = make_shared<const vector<LevelMirror> >(M, M + level->mirrors);
 }
 
-struct Mirror { 
-  float a, b, c;
-  float x1, x2, y1, y2;
-  float angle;
-};
-
-Mirror m[4];
-
+/* Mirror bars are uploaded again only when the level changes */
 void createMirrors ()
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  //PI/4 with the x-axis
-  const GLfloat vertex_buffer_data1 [] = {
-    -12,-10,0, // vertex 1
-    -12+cos(M_PI/4),-cos(M_PI/4)-10,0, // vertex 2
-    -12+9*cos(M_PI/4)+sin(M_PI/4),-10+9*cos(M_PI/4)-cos(M_PI/4),0, //vertex 3
-   
-    -12+9*cos(M_PI/4)+sin(M_PI/4),-10+9*cos(M_PI/4)-cos(M_PI/4),0, //vertex 3
-    -12+9*cos(M_PI/4),-10+9*cos(M_PI/4),0,//vertex 4
-    -12,-10,0 //vertex 1
-  };
-
-  float v1x = -12, v2x = -12+10*cos(M_PI/4), v1y = -10, v2y = -10+8*cos(M_PI/4);
-  m[1].x1 = v1x, m[1].x2 = v2x, m[1].y1 = v1y, m[1].y2 = v2y;
-  m[1].a = -(v2y - v1y);
-  m[1].b = v2x - v1x;
-  m[1].c = v1y*(v2x-v1x) - v1x*(v2y-v1y);
-  m[1].angle = M_PI/4;
-  const GLfloat color_buffer_data1 [] = {
-    0,0,0,  //color 1
-    0,0,0,  //color 2
-    0,0,0,  //color 3
-
-    0,0,0,  //color 3
-    0,0,0,  //color 4
-    0,0,0   //color 1
-  };
-
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  mirror1 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data1, color_buffer_data1, GL_FILL);
-
-  //2*PI/3 with the x-axis
-  GLfloat vertex_buffer_data2 [] = {
-    32,30,0, // vertex 1
-    32+cos(M_PI/6),30+sin(M_PI/6),0, // vertex 2
-    32+cos(M_PI/6)-9*cos(M_PI/3),30+sin(M_PI/6)+9*sin(M_PI/3),0, //vertex 3
-
-    32+cos(M_PI/6)-9*cos(M_PI/3),30+sin(M_PI/6)+9*sin(M_PI/3),0, //vertex 3
-    32-9*cos(M_PI/3),30+9*sin(M_PI/3),0,//vertex 4
-    32,30,0 //vertex 1
-  };
-
-  GLfloat color_buffer_data2 [] = {
-    0,0,0,  //color 1
-    0,0,0,  //color 2
-    0,0,0,  //color 3
-
-    0,0,0,  //color 3
-    0,0,0,  //color 4
-    0,0,0   //color 1
-  };
-
-  v1x = 32, v2x = 32-9*cos(M_PI/3), v1y = 30, v2y = 30+9*sin(M_PI/3);
-  m[2].x1 = v1x, m[2].x2 = v2x, m[2].y1 = v1y, m[2].y2 = v2y;
-  m[2].a = -(v2y - v1y);
-  m[2].b = v2x - v1x;
-  m[2].c = v1y*(v2x-v1x) - v1x*(v2y-v1y);
-  m[2].angle = (2*M_PI)/3;
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  mirror2 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data2, color_buffer_data2, GL_FILL);
-
-  //PI/3 with the x-axis
-  GLfloat vertex_buffer_data3 [] = {
-    25,-20,0, // vertex 1
-    25+10*cos(M_PI/3),-20+10*sin(M_PI/3),0, // vertex 2
-    25+10*cos(M_PI/3)+cos(M_PI/6),-20+10*sin(M_PI/3)-sin(M_PI/6),0,//vertex 3
-
-    25+10*cos(M_PI/3)+cos(M_PI/6),-20+10*sin(M_PI/3)-sin(M_PI/6),0,//vertex 3
-    25+cos(M_PI/6),-20-sin(M_PI/6),0,//vertex 4
-    25,-20,0 //vertex 1
-  };
-
-  GLfloat color_buffer_data3 [] = {
-    0,0,0,  //color 1
-    0,0,0,  //color 2
-    0,0,0,  //color 3
-
-    0,0,0,  //color 3
-    0,0,0,  //color 4
-    0,0,0   //color 1
-  };
-  
-  v1x = 25, v2x = 25+10*cos(M_PI/3), v1y = -20, v2y = -20+10*sin(M_PI/3);
-  m[3].x1 = v1x, m[3].x2 = v2x, m[3].y1 = v1y, m[3].y2 = v2y;
-  m[3].a = -(v2y - v1y);
-  m[3].b = v2x - v1x;
-  m[3].c = v1y*(v2x-v1x) - v1x*(v2y-v1y);
-  m[3].angle = M_PI/3;
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  mirror3 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data3, color_buffer_data3, GL_FILL);
+  createMirrorGeometry();
+  mirror_batch = create3DObject(GL_TRIANGLES, 0, NULL, (const GLfloat*)NULL, GL_FILL);
 }
 
 void createRectangle ()
@@ -582,96 +759,676 @@ void createRectangle ()
   rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
 }
 
-float gapx = 10, gapy = 10, maxy = -1; 
+const GLfloat block_colors[3][3] = {
+  { 1, 0, 0 }, // red
+  { 0, 1, 0 }, // green
+  { 0, 0, 0 }  // black
+};
+
+/* Spawning is scheduled in simulation time rather than by stacking each new
+   block above the last one. A wave spawns 'remaining' blocks 'interval'
+   seconds apart; each wave has at most one entry in the pending queue (its
+   next spawn), so memory and per-frame work track the waves and the blocks
+   actually in play, never the length of the column. Blocks are created at
+   spawn_line, just above the view, when they are due. */
+struct Wave {
+  double start;      // seconds of simulation time
+  int remaining;     // blocks still to spawn
+  double interval;   // seconds between spawns, 0 = classic column spacing
+  float xmin, xmax;
+  int colors;        // bitmask: 1 red, 2 green, 4 black
+  bool refill;       // blocks removed from play are spawned again
+  double next_due;
+  bool queued;
+};
+
+struct PendingSpawn {
+  double due;
+  int wave;
+  bool operator> (const PendingSpawn &o) const { return due > o.due; }
+};
+
+const double tick_dt = 1.0/60;  // one simulation step per frame at vsync
+const float spawn_line = 50;    // world y where blocks appear (view top is 40)
+double sim_time = 0;
+vector<Wave> wave_script;       // from --waves; empty = classic endless game
+const char *waves_path = NULL;
+vector<Wave> waves;
+/* Min-heap of next spawns; heap() exposes the storage for savestates */
+struct SpawnQueue : priority_queue<PendingSpawn, vector<PendingSpawn>, greater<PendingSpawn> > {
+  vector<PendingSpawn>& heap () { return c; }
+};
+SpawnQueue pending;
+
+/* Gameplay RNG (the classic ANSI C rand), so savestates can carry its state */
+unsigned rng_state = 1;
+
+int game_rand ()
+{
+  rng_state = rng_state * 1103515245 + 12345;
+  return (rng_state >> 16) & 0x7fff;
+}
+
+/* Seconds between spawns of a wave at the current fall speed */
+double wave_interval (const Wave &w)
+{
+  if (w.interval > 0)
+    return w.interval;
+  // Classic column: one block height plus gapy between consecutive blocks
+  return (3 + level->gapy) / (block_trans / tick_dt);
+}
+
+void queue_wave (int k, double due)
+{
+  Wave &w = waves[k];
+  if (w.queued || w.remaining <= 0)
+    return;
+  w.next_due = due;
+  w.queued = true;
+  pending.push((PendingSpawn){due, k});
+}
+
 //create pieces
-void createPieces (int i)
+/* (Re)initialise pool slot i with a fresh block from wave w at height y */
+void createPieces (int i, int w, float y)
 {
-  // GL3 accepts only Triangles. Quads are not supported
+  Piece &P = pool.cur[i];
+  const Wave &W = waves[w];
+  P.x1 = W.xmin + (game_rand() % max(1, (int)(W.xmax - W.xmin + 1)));
+  P.x2 = P.x1 + 1;
+  int color;
+  do {
+    color = game_rand() % 3;
+  } while (!(W.colors & (1 << color)));
+  P.color = color;
+  P.y1 = y;
+  P.y2 = P.y1 + 3;
+  P.wave = w;
+  pool.gen[i]++;
+}
+
+/* New block in a free slot */
+int spawn_block (int w, float y)
+{
+  int slot = pool.alloc();
+  createPieces(slot, w, y);
+  if(spawn_log.size() >= 4096)
+    invalidate_beam_cache(); // not firing for a while; next shot queries afresh
+  spawn_log.push_back(pool.handle(slot));
+  return slot;
+}
+
+void despawn_block (int slot)
+{
+  pool.release(slot);
+}
 
-  float val1 = (rand() % 50);
-  val1 -= 30;
-  Block[i].color = rand() % 3;
-  Block[i].trans = 0;
-  Block[i].x1 = val1 + gapx;
-  Block[i].x2 = Block[i].x1 + 1;
-  if(maxy == -1) { 
-    Block[i].y1 = 40 + gapy; 
-    Block[i].y2 = Block[i].y1 + 3;
-    maxy = i;
+/* A block left play (shot or reached the water); refilling waves replace it */
+void remove_block (int slot)
+{
+  int k = pool.cur[slot].wave;
+  despawn_block(slot);
+  if (waves[k].refill) {
+    waves[k].remaining++;
+    queue_wave(k, max(waves[k].next_due + wave_interval(waves[k]), sim_time));
   }
-  else {
-    Block[i].y1 = current[(int)maxy].y2 + gapy;
-    Block[i].y2 = Block[i].y1 + 3;
-    maxy = i;
-  }
-  float X1 = Block[i].x1;
-  current[i].x1 = X1;
-  float X2 = Block[i].x2;
-  current[i].x2 = X2;
-  float Y1 = Block[i].y1;
-  current[i].y1 = Y1;
-  float Y2 = Block[i].y2;
-  current[i].y2 = Y2;
-  current[i].color = Block[i].color;
-  current[i].trans = Block[i].trans;
-  
+}
+
+/* Advance the clock and create every block that is due. A spawn that is
+   late by dt appears already dt of fall below spawn_line. */
+void run_spawner ()
+{
+  sim_time += tick_dt;
+  while (!pending.empty() && pending.top().due <= sim_time) {
+    int k = pending.top().wave;
+    pending.pop();
+    Wave &w = waves[k];
+    w.queued = false;
+    float late = (sim_time - w.next_due) / tick_dt * block_trans;
+    spawn_block(k, spawn_line - late);
+    w.remaining--;
+    queue_wave(k, w.next_due + wave_interval(w));
+  }
+}
+
+/* Nothing in play and nothing left to spawn */
+bool spawner_idle ()
+{
+  return pending.empty() && pool.size() == 0;
+}
+
+/* Start the scripted waves, or the classic endless column of num_blocks */
+void reset_waves ()
+{
+  while (!pending.empty())
+    pending.pop();
+  sim_time = 0;
+  waves = wave_script;
+  if (waves.empty()) {
+    Wave w = { 0, num_blocks, 0, level->spawn_xmin, level->spawn_xmax, 7, true, 0, false };
+    if (stress_mode) {
+      // Pre-aged: the crowd is already spread over the view at t = 0
+      double crossing = (spawn_line - level->water_line) / (block_trans / tick_dt);
+      w.interval = crossing / num_blocks;
+      w.start = -crossing;
+    }
+    waves.push_back(w);
+  }
+  for(int k = 0; k < (int)waves.size(); k++) {
+    waves[k].queued = false;
+    queue_wave(k, waves[k].start);
+  }
+}
+
+/* Wave script: one wave per line,
+     wave <start s> <count> <interval s | stack> <xmin> <xmax> <colours from rgb> [refill] */
+bool load_waves (const char* path)
+{
+  ifstream in(path);
+  if (!in.is_open()) {
+    fprintf(stderr, "Error: cannot read wave script %s\n", path);
+    return false;
+  }
+  string line;
+  while (getline(in, line)) {
+    char interval[32], colors[8], refill[16] = "";
+    Wave w = { 0, 0, 0, 0, 0, 0, false, 0, false };
+    if (line.empty() || line[0] == '#')
+      continue;
+    if (sscanf(line.c_str(), "wave %lf %d %31s %f %f %7s %15s", &w.start, &w.remaining, interval,
+               &w.xmin, &w.xmax, colors, refill) < 6) {
+      fprintf(stderr, "Error: bad wave line: %s\n", line.c_str());
+      return false;
+    }
+    w.interval = strcmp(interval, "stack") ? atof(interval) : 0;
+    for (const char *p = colors; *p; p++)
+      w.colors |= *p == 'r' ? 1 : *p == 'g' ? 2 : *p == 'b' ? 4 : 0;
+    if (!w.colors)
+      w.colors = 7;
+    w.refill = !strcmp(refill, "refill");
+    wave_script.push_back(w);
+  }
+  return true;
+}
+
+/* One unit block (1 x 3) per colour, placed with a model matrix */
+void createBlockQuads ()
+{
+  // GL3 accepts only Triangles. Quads are not supported
   const GLfloat vertex_buffer_data [] = {
-    X1, Y1,0, // vertex 1
-    X2, Y1,0, // vertex 2
-    X2, Y2,0, // vertex 3
+    0, 0,0, // vertex 1
+    1, 0,0, // vertex 2
+    1, 3,0, // vertex 3
 
-    X2, Y2,0, // vertex 3
-    X1, Y2,0, // vertex 4
-    X1, Y1,0  // vertex 1
+    1, 3,0, // vertex 3
+    0, 3,0, // vertex 4
+    0, 0,0  // vertex 1
   };
 
-  //GLfloat color_buffer_data [20];
+  for(int k = 0; k < 3; k++) {
+    block_quad[k] = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, block_colors[k][0], block_colors[k][1], block_colors[k][2], GL_FILL);
+  }
+
+  // Streamed every frame with all live blocks when batch_blocks is on
+  block_batch = create3DObject(GL_TRIANGLES, 0, NULL, (const GLfloat*)NULL, GL_FILL);
+}
 
-  if(current[i].color == 0) { 
-      const GLfloat color_buffer_data [] = {
-      1,0,0, // color 1
-      1,0,0, // color 2
-      1,0,0, // color 3
+/* Everything draw() needs from one simulation tick. The simulation fills
+   one in and never touches it again once it is published. */
+struct RenderSnapshot {
+  vector<Piece> blocks;
+  vector<Lazer> beams;
+  shared_ptr<const vector<LevelMirror> > mirrors;
+  float water_line;
+  float b1, b2;
+  float score, speed;
+  vector<Cannon> cannons;
+  float zoom, pan;
+  bool Shoot;   // any cannon firing
+};
 
-      1,0,0, // color 3
-      1,0,0, // color 4
-      1,0,0  // color 1
-    };
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  box[i] = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+void take_snapshot (RenderSnapshot &S)
+{
+  S.blocks.resize(pool.size());
+  for(int n = 0; n < pool.size(); n++)
+    S.blocks[n] = pool.cur[pool.live[n]];
+  S.beams = L;
+  S.mirrors = mirror_art;
+  S.water_line = level->water_line;
+  S.b1 = b1, S.b2 = b2;
+  S.score = Score, S.speed = block_trans;
+  S.cannons.assign(cannons, cannons + num_cannons);
+  S.zoom = zoom, S.pan = pan;
+  S.Shoot = any_firing();
+}
 
+/* Single producer / single consumer triple buffer. The writer always owns
+   one slot, the reader another, and the third holds the latest published
+   one; publish and acquire just swap indices, so neither side ever waits. */
+template <class T>
+class TripleBuffer {
+  T slots[3];
+  atomic<int> middle;   // slot index, plus FRESH when not yet acquired
+  int back, front;
+  enum { FRESH = 4 };
+public:
+  TripleBuffer () : middle(1), back(0), front(2) {}
+  T& write_buffer () { return slots[back]; }
+  void publish () { back = middle.exchange(back | FRESH) & ~FRESH; }
+  /* Switch to the newest published slot; false if nothing new */
+  bool acquire () {
+    if (!(middle.load() & FRESH))
+      return false;
+    front = middle.exchange(front) & ~FRESH;
+    return true;
   }
-  else if(current[i].color == 1) { 
-      const GLfloat color_buffer_data [] = {
-      0,1,0, // color 1
-      0,1,0, // color 2
-      0,1,0, // color 3
+  const T& read_buffer () const { return slots[front]; }
+};
 
-      0,1,0, // color 3
-      0,1,0, // color 4
-      0,1,0  // color 1
-    };
+/* World-space rectangle shown by the ortho projection in draw() */
+struct ViewRect {
+  float left, right, bottom, top;
+};
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    box[i] = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  }
+ViewRect view_rect (float zoom, float pan)
+{
+  return (ViewRect){ -40.0f/zoom + pan, 40.0f/zoom + pan, -40.0f/zoom, 40.0f/zoom };
+}
 
-  else if(current[i].color == 2) { 
-     const  GLfloat color_buffer_data [] = {
-      0,0,0, // color 1
-      0,0,0, // color 2
-      0,0,0, // color 3
+/* Snapshot blocks that intersect the view this frame, and how many were skipped */
+vector<int> visible_blocks;
+int blocks_drawn = 0, blocks_culled = 0;
 
-      0,0,0, // color 3
-      0,0,0, // color 4
-      0,0,0  // color 1
+void cull_blocks (const vector<Piece> &blocks, const ViewRect &V)
+{
+  visible_blocks.clear();
+  for(int i = 0; i < (int)blocks.size(); i++) {
+    const Piece &P = blocks[i];
+    if (P.x2 >= V.left && P.x1 <= V.right && P.y2 >= V.bottom && P.y1 <= V.top)
+      visible_blocks.push_back(i);
+  }
+  blocks_drawn = visible_blocks.size();
+  blocks_culled = blocks.size() - blocks_drawn;
+}
+
+/* Rebuild the block batch from the visible blocks and draw it in one call */
+void drawBlockBatch (const vector<Piece> &blocks)
+{
+  static vector<GLfloat> vertices, colors;
+  int n = visible_blocks.size();
+  vertices.resize(18*n);
+  colors.resize(18*n);
+  for(int k = 0; k < n; k++) {
+    const Piece &P = blocks[visible_blocks[k]];
+    const GLfloat quad[18] = {
+      P.x1, P.y1, 0,  P.x2, P.y1, 0,  P.x2, P.y2, 0,
+      P.x2, P.y2, 0,  P.x1, P.y2, 0,  P.x1, P.y1, 0
     };
+    const GLfloat *rgb = block_colors[(int)P.color];
+    GLfloat *v = &vertices[18*k], *col = &colors[18*k];
+    for(int j = 0; j < 18; j++) {
+      v[j] = quad[j];
+      col[j] = rgb[j % 3];
+    }
+  }
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  box[i] = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  // Orphan and refill both buffers
+  glBindVertexArray(block_batch->VertexArrayID);
+  glBindBuffer(GL_ARRAY_BUFFER, block_batch->VertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(GLfloat), n ? &vertices[0] : NULL, GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, block_batch->ColorBuffer);
+  glBufferData(GL_ARRAY_BUFFER, colors.size()*sizeof(GLfloat), n ? &colors[0] : NULL, GL_STREAM_DRAW);
+  upload_bytes += (vertices.size() + colors.size())*sizeof(GLfloat);
+  block_batch->NumVertices = 6*n;
+  if (n)
+    draw3DObject(block_batch);
+}
+
+/* All beam segments of the snapshot as one GL_LINES draw */
+void drawBeamBatch (const vector<Lazer> &beams)
+{
+  static vector<GLfloat> vertices, colors;
+  int n = beams.size();
+  vertices.resize(6*n);
+  colors.assign(6*n, 0);
+  for(int k = 0; k < n; k++) {
+    const GLfloat seg[6] = { beams[k].x1, beams[k].y1, 0, beams[k].x2, beams[k].y2, 0 };
+    for(int j = 0; j < 6; j++)
+      vertices[6*k + j] = seg[j];
+    colors[6*k + 2] = colors[6*k + 5] = 1; // blue
   }
+
+  glBindVertexArray(beam_batch->VertexArrayID);
+  glBindBuffer(GL_ARRAY_BUFFER, beam_batch->VertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(GLfloat), n ? &vertices[0] : NULL, GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, beam_batch->ColorBuffer);
+  glBufferData(GL_ARRAY_BUFFER, colors.size()*sizeof(GLfloat), n ? &colors[0] : NULL, GL_STREAM_DRAW);
+  upload_bytes += (vertices.size() + colors.size())*sizeof(GLfloat);
+  beam_batch->NumVertices = 2*n;
+  if (n)
+    draw3DObject(beam_batch);
 }
   
+/* Every mirror as a one unit thick bar under its edge, laid along its
+   angle, in one draw. Uploaded only when the level changed. */
+void drawMirrorBatch (const shared_ptr<const vector<LevelMirror> > &mirrors)
+{
+  static shared_ptr<const vector<LevelMirror> > uploaded; // held, so never a reused address
+  if (!mirrors || mirrors->empty())
+    return;
+  int n = mirrors->size();
+  if (mirrors != uploaded) {
+    vector<GLfloat> vertices(18*n), colors(18*n, 0);
+    for(int k = 0; k < n; k++) {
+      const LevelMirror &M = (*mirrors)[k];
+      float len = hypot(M.x2 - M.x1, M.y2 - M.y1);
+      float ux = len*cos(M.angle), uy = len*sin(M.angle);   // along the edge
+      float nx = sin(M.angle), ny = -cos(M.angle);          // unit thickness
+      const GLfloat bar[18] = {
+        M.x1, M.y1, 0,   M.x1 + ux, M.y1 + uy, 0,   M.x1 + ux + nx, M.y1 + uy + ny, 0,
+        M.x1 + ux + nx, M.y1 + uy + ny, 0,   M.x1 + nx, M.y1 + ny, 0,   M.x1, M.y1, 0
+      };
+      for(int j = 0; j < 18; j++)
+        vertices[18*k + j] = bar[j];
+    }
+    glBindVertexArray(mirror_batch->VertexArrayID);
+    glBindBuffer(GL_ARRAY_BUFFER, mirror_batch->VertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(GLfloat), &vertices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, mirror_batch->ColorBuffer);
+    glBufferData(GL_ARRAY_BUFFER, colors.size()*sizeof(GLfloat), &colors[0], GL_STATIC_DRAW);
+    upload_bytes += (vertices.size() + colors.size())*sizeof(GLfloat);
+    mirror_batch->NumVertices = 6*n;
+    uploaded = mirrors;
+  }
+  draw3DObject(mirror_batch);
+}
+
+/* HUD text: glyph quads out of the font atlas (hud_font.h), every line in
+   one vertex stream drawn with one call. Line k owns a fixed run of
+   hud_line_chars quads at a fixed place; setting it to the text it shows
+   already is a string compare, other text rewrites and uploads only that
+   run. Quads past the end of a line collapse to a point. */
+const int hud_lines = 4, hud_line_chars = 20;
+const int hud_floats = 7;                // x, y, u, v, r, g, b per vertex
+const float hud_pixel = 80.0f / 300;     // font pixel: 2 window pixels at 600x600
+
+struct HudText {
+  GLuint program, MatrixID;
+  GLuint vao, vbo, atlas;
+  string shown[hud_lines];
+  GLfloat run[hud_line_chars * 6 * hud_floats];  // one line's vertices
+} hud;
+
+void createHud ()
+{
+  hud.program = LoadShaders("Sample_Text.vert", "Sample_Text.frag");
+  hud.MatrixID = glGetUniformLocation(hud.program, "MVP");
+
+  vector<unsigned char> texels;
+  int width, height;
+  build_font_atlas(texels, width, height);
+  glGenTextures(1, &hud.atlas);
+  glBindTexture(GL_TEXTURE_2D, hud.atlas);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, &texels[0]);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  vector<GLfloat> blank(hud_lines * sizeof hud.run / sizeof(GLfloat), 0);
+  glGenVertexArrays(1, &hud.vao);
+  glGenBuffers(1, &hud.vbo);
+  gl_objects_created += 3;
+  glBindVertexArray(hud.vao);
+  glBindBuffer(GL_ARRAY_BUFFER, hud.vbo);
+  glBufferData(GL_ARRAY_BUFFER, blank.size()*sizeof(GLfloat), &blank[0], GL_DYNAMIC_DRAW);
+  const GLsizei stride = hud_floats * sizeof(GLfloat);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void*)0);
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void*)(2*sizeof(GLfloat)));
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void*)(4*sizeof(GLfloat)));
+  for(int k = 0; k < hud_lines; k++)
+    hud.shown[k].clear();
+}
+
+/* One textured quad, two triangles of hud_floats-float vertices, at out */
+void hud_quad (GLfloat *out, float x0, float y0, float x1, float y1,
+               float u0, float v0, float u1, float v1, float r, float g, float b)
+{
+  const GLfloat quad[6 * hud_floats] = {
+    x0, y0, u0, v0, r, g, b,   x1, y0, u1, v0, r, g, b,   x1, y1, u1, v1, r, g, b,
+    x1, y1, u1, v1, r, g, b,   x0, y1, u0, v1, r, g, b,   x0, y0, u0, v0, r, g, b
+  };
+  memcpy(out, quad, sizeof quad);
+}
+
+/* Glyph quads of up to max_chars of text, top-left corner at (x, y), one
+   after another at out (spaces take none); returns how many were written */
+int hud_text (GLfloat *out, const char *text, int max_chars, float x, float y, float r, float g, float b)
+{
+  int n = min((int)strlen(text), max_chars), quads = 0;
+  const float w = cell_w * hud_pixel, h = cell_h * hud_pixel;
+  for(int i = 0; i < n; i++) {
+    int glyph = hud_glyph(text[i]);
+    if (!glyph)
+      continue;
+    hud_quad(out + quads++ * 6 * hud_floats, x + i*w, y - h, x + (i+1)*w, y,
+             (float)glyph / hud_glyphs, 0, (float)(glyph + 1) / hud_glyphs, 1, r, g, b);
+  }
+  return quads;
+}
+
+/* Show 'text' on line k, top-left corner at (x, y) in unzoomed view units */
+void hud_line (int k, const char *text, float x, float y, float r, float g, float b)
+{
+  if (hud.shown[k] == text)
+    return;
+  hud.shown[k] = text;
+  memset(hud.run, 0, sizeof hud.run);
+  hud_text(hud.run, text, hud_line_chars, x, y, r, g, b);
+  glBindBuffer(GL_ARRAY_BUFFER, hud.vbo);
+  glBufferSubData(GL_ARRAY_BUFFER, k * sizeof hud.run, sizeof hud.run, hud.run);
+  upload_bytes += sizeof hud.run;
+}
+
+/* Frames drawn per second, counted over half-second windows */
+int hud_fps ()
+{
+  static double window_start = glfwGetTime();
+  static int frames = 0, fps = 0;
+  double now = glfwGetTime();
+  frames++;
+  if (now - window_start >= 0.5) {
+    fps = (int)(frames / (now - window_start) + 0.5);
+    frames = 0;
+    window_start = now;
+  }
+  return fps;
+}
+
+/* Every HUD line in one draw, over the unzoomed view. z 0 is on the near
+   plane of this projection, so the text passes the depth test over
+   everything. */
+void drawHud ()
+{
+  glUseProgram(hud.program);
+  glm::mat4 MVP = glm::ortho(-40.0f, 40.0f, -40.0f, 40.0f, 0.0f, 1.0f);
+  glUniformMatrix4fv(hud.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glBindTexture(GL_TEXTURE_2D, hud.atlas);
+  glBindVertexArray(hud.vao);
+  glDrawArrays(GL_TRIANGLES, 0, hud_lines * hud_line_chars * 6);
+  draw_calls++;
+  draw_vertices += hud_lines * hud_line_chars * 6;
+}
+
+/* Performance overlay (F3 or --perf): a graph of the last perf_frames
+   frame times and counters from the main loop, the simulation thread and
+   the draw() it is part of. Bars and text are quads out of the HUD's atlas
+   in one dynamic buffer, drawn with the HUD's program in one call. The
+   graph is uploaded every frame; the text, averaged over half-second
+   windows, only when a window closes. Text quads are packed and only the
+   quads in use are drawn. The main loop feeds it whether it is
+   shown or not, which is a few clock reads per frame. */
+enum LoopPhase { LOOP_AUDIO, LOOP_SIM, LOOP_DRAW, LOOP_SWAP, LOOP_INPUT, LOOP_PHASES };
+const char *const loop_phase_names[LOOP_PHASES] = { "AUDIO", "SIM", "DRAW", "SWAP", "INPUT" };
+
+const int perf_frames = 120;                      // bars on the graph
+const int perf_lines = 14, perf_line_chars = 24;
+const int perf_text = perf_frames + 1;            // first text quad, after the bars and the 60 Hz mark
+const int perf_quads = perf_text + perf_lines * perf_line_chars;
+const float perf_bar_w = 0.3f, perf_ms_h = 0.3f;  // view units per bar and per millisecond
+const float perf_graph_ms = 40;                   // taller frames are clipped
+
+struct PerfOverlay {
+  GLuint vao, vbo;
+  float frame_ms[perf_frames];      // ring, newest at 'newest'
+  int newest;
+  /* The window being summed */
+  double window_start, frame_sum, phase_sum[LOOP_PHASES];
+  int window_frames;
+  long audio_bytes;                 // played
+  /* The last closed window */
+  float fps, avg_frame_ms, phase_ms[LOOP_PHASES], audio_fed;
+  bool fresh;                       // closed since the text was built
+  long audio_bytes_per_s;           // the stream's rate, set by main; 0 without audio
+  GlFrameStats gl;                  // the last frame's GL calls, in GL_TRACE builds
+  int text_quads;                   // in use after perf_text
+  double cost_ms;                   // building, uploading and drawing the overlay
+  GLfloat verts[perf_quads * 6 * hud_floats];
+} perf;
+
+atomic<float> sim_tick_ms(0);  // the last simulation tick, from either loop
+
+void createPerfOverlay ()
+{
+  glGenVertexArrays(1, &perf.vao);
+  glGenBuffers(1, &perf.vbo);
+  gl_objects_created += 2;
+  glBindVertexArray(perf.vao);
+  glBindBuffer(GL_ARRAY_BUFFER, perf.vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof perf.verts, NULL, GL_DYNAMIC_DRAW);
+  const GLsizei stride = hud_floats * sizeof(GLfloat);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void*)0);
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void*)(2*sizeof(GLfloat)));
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void*)(4*sizeof(GLfloat)));
+  perf.window_start = glfwGetTime();
+}
+
+/* Main loop: phase p ran from t until now; returns now */
+double perf_phase (LoopPhase p, double t)
+{
+  double now = glfwGetTime();
+  perf.phase_sum[p] += now - t;
+  return now;
+}
+
+/* Main loop: a frame took ms, swap to swap. Closes the window when due. */
+void perf_frame (double ms)
+{
+  perf.newest = (perf.newest + 1) % perf_frames;
+  perf.frame_ms[perf.newest] = ms;
+  perf.frame_sum += ms;
+  perf.window_frames++;
+  double now = glfwGetTime(), span = now - perf.window_start;
+  if (span < 0.5)
+    return;
+  perf.fps = perf.window_frames / span;
+  perf.avg_frame_ms = perf.frame_sum / perf.window_frames;
+  for(int p = 0; p < LOOP_PHASES; p++) {
+    perf.phase_ms[p] = perf.phase_sum[p] * 1000 / perf.window_frames;
+    perf.phase_sum[p] = 0;
+  }
+  perf.audio_fed = perf.audio_bytes_per_s ? 100.0 * perf.audio_bytes / (perf.audio_bytes_per_s * span) : 0;
+  perf.audio_bytes = 0;
+  perf.frame_sum = 0;
+  perf.window_frames = 0;
+  perf.window_start = now;
+  perf.fresh = true;
+}
+
+/* The overlay's text into its quads, from the last window and this frame's
+   counters so far */
+void perf_text_lines (const RenderSnapshot &S)
+{
+  char line[perf_lines][perf_line_chars + 1];
+  int n = 0;
+  snprintf(line[n++], sizeof line[0], "FPS %.0f FRAME %.2fMS", perf.fps, perf.avg_frame_ms);
+  for(int p = 0; p < LOOP_PHASES; p++)
+    snprintf(line[n++], sizeof line[0], "%-6s %7.3fMS", loop_phase_names[p], perf.phase_ms[p]);
+  snprintf(line[n++], sizeof line[0], "TICK   %7.3fMS", sim_tick_ms.load());
+  snprintf(line[n++], sizeof line[0], "DRAWS %d VERTS %ld", draw_calls, draw_vertices);
+  snprintf(line[n++], sizeof line[0], "UPLOAD %.1fKB", upload_bytes / 1024.0);
+  snprintf(line[n++], sizeof line[0], "GL MADE %d FREED %d", gl_objects_created, gl_objects_deleted);
+  if (gl_trace_enabled)
+    snprintf(line[n++], sizeof line[0], "GL CALLS %ld ERRORS %ld", perf.gl.calls, perf.gl.errors);
+  if (perf.audio_bytes_per_s)
+    snprintf(line[n++], sizeof line[0], "AUDIO FED %.0f%%", perf.audio_fed);
+  else
+    snprintf(line[n++], sizeof line[0], "AUDIO OFF");
+  snprintf(line[n++], sizeof line[0], "BLOCKS %d CULLED %d", (int)S.blocks.size(), blocks_culled);
+  snprintf(line[n++], sizeof line[0], "OVERLAY %.3fMS", perf.cost_ms);
+
+  perf.text_quads = 0;
+  for(int k = 0; k < n; k++)
+    perf.text_quads += hud_text(perf.verts + (perf_text + perf.text_quads) * 6 * hud_floats, line[k],
+                                perf_line_chars, -30, 29 - 2.5f*k, 0, 0, 0.4f);
+}
+
+/* Graph and counters over the unzoomed view, after the HUD */
+void drawPerfOverlay (const RenderSnapshot &S)
+{
+  static bool was_shown = false;
+  if (!perf_overlay) {
+    was_shown = false;
+    return;
+  }
+  double start = glfwGetTime();
+
+  // Oldest frame on the left; green within a 60 Hz frame (and a bit), red past it
+  float u, v;
+  hud_solid_texel(u, v);
+  const float gx = -30, gy = -16;
+  for(int k = 0; k < perf_frames; k++) {
+    float ms = perf.frame_ms[(perf.newest + 1 + k) % perf_frames];
+    bool slow = ms > 1000.0f/60 + 1;
+    hud_quad(perf.verts + k * 6 * hud_floats, gx + k*perf_bar_w, gy, gx + (k+1)*perf_bar_w,
+             gy + min(ms, perf_graph_ms) * perf_ms_h, u, v, u, v, slow ? 0.9f : 0, slow ? 0 : 0.7f, 0);
+  }
+  float y60 = gy + 1000.0f/60 * perf_ms_h;
+  hud_quad(perf.verts + perf_frames * 6 * hud_floats, gx, y60, gx + perf_frames*perf_bar_w, y60 + 0.15f,
+           u, v, u, v, 0, 0, 1);
+
+  bool text = perf.fresh || !was_shown;
+  if (text)
+    perf_text_lines(S);
+  perf.fresh = false;
+  was_shown = true;
+
+  int quads = perf_text + perf.text_quads;
+  size_t bytes = (text ? quads : perf_text) * 6 * hud_floats * sizeof(GLfloat);
+  glBindVertexArray(perf.vao);
+  glBindBuffer(GL_ARRAY_BUFFER, perf.vbo);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, perf.verts);
+  upload_bytes += bytes;
+
+  glUseProgram(hud.program);
+  glm::mat4 MVP = glm::ortho(-40.0f, 40.0f, -40.0f, 40.0f, 0.0f, 1.0f);
+  glUniformMatrix4fv(hud.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glBindTexture(GL_TEXTURE_2D, hud.atlas);
+  glDrawArrays(GL_TRIANGLES, 0, quads * 6);
+  draw_calls++;
+  draw_vertices += quads * 6;
+  perf.cost_ms = (glfwGetTime() - start) * 1000;
+}
+
 void createWater()
 {
   // GL3 accepts only Triangles. Quads are not supported
@@ -832,14 +1589,323 @@ void createCanon()
   return; 
 }
 
-float camera_rotation_angle = 90;
-float rectangle_rotation = 0;
-float triangle_rotation = 0;
+/* Let every falling piece drop by block_trans (once per frame, after draw) */
+void update_blocks ()
+{
+  jobs.parallel_for(0, pool.size(), job_grain, [](int begin, int end) {
+    for(int n = begin; n < end; n++) {
+      Piece &P = pool.cur[pool.live[n]];
+      P.y1 -= block_trans;
+      P.y2 -= block_trans;
+    }
+  });
+  total_fall += block_trans;
+}
 
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-void draw ()
+/* Cannons spread evenly over the level's cannon range, level, batteries flat */
+void place_cannons ()
 {
+  const float span = level->cannon_max - level->cannon_min;
+  for(int k = 0; k < num_cannons; k++) {
+    Cannon &C = cannons[k];
+    C.y = level->cannon_min + (k + 0.5f) * span / num_cannons;
+    C.rot = 0;
+    battery_reset(C.battery, 0, 0);
+    C.firing = false;
+  }
+  schedule_batteries();
+}
+
+/* Put gameplay state back to the start of a game and spawn a fresh column */
+void reset_game ()
+{
+  Score = 0;
+  events.clear();
+  memset(event_counts, 0, sizeof event_counts);
+  game_fall_start = total_fall;
+  frame_times.clear();
+  zoom = 1, pan = 0;
+  block_trans = 0.3;
+  b1 = level->basket_start[0], b2 = level->basket_start[1];
+  scored_b1 = b1, scored_b2 = b2;
+  place_cannons();
+  L.clear();
+  frame_no = 0;
+
+  rng_state = game_seed;
+  pool.clear();
+  reset_waves();
+  invalidate_beam_cache();
+}
+
+/* Put the current level's mirrors and limits into a game in progress */
+void apply_level ()
+{
+  createMirrorGeometry();
+  b1 = min(max(b1, level->basket_min[0]), level->basket_max[0]);
+  b2 = min(max(b2, level->basket_min[1]), level->basket_max[1]);
+  for(int k = 0; k < num_cannons; k++) {
+    Cannon &C = cannons[k];
+    C.y = min(max(C.y, level->cannon_min), level->cannon_max);
+    C.rot = min(max(C.rot, -level->turn_limit), level->turn_limit);
+  }
+  if (wave_script.empty() && !waves.empty())
+    waves[0].xmin = level->spawn_xmin, waves[0].xmax = level->spawn_xmax;
+  invalidate_beam_cache();
+}
+
+/* Load a level file into the free slot and make it current */
+bool load_level (const char* path)
+{
+  LevelFile &next = level_file[1 - level_slot];
+  if (!next.load(path))
+    return false;
+  level_slot = 1 - level_slot;
+  level = next.level;
+  level_file[1 - level_slot].close();
+  return true;
+}
+
+/* Hot reload: between ticks, if the level file was rewritten, swap it in.
+   A file that does not load leaves the current level in play. */
+void reload_level ()
+{
+  if (!level_path || record_file || !level_watch.changed())
+    return;
+  if (load_level(level_path)) {
+    apply_level();
+    cout << "Reloaded level " << level_path << endl;
+  }
+}
+
+/* Savestates: the whole simulation as one flat POD blob, a SaveHeader
+   followed by the pool, wave, spawn-queue and cannon arrays in header order.
+   Input and render state are not part of it. */
+struct SaveHeader {
+  char magic[8];
+  unsigned size;     // bytes, header included
+  int slots, live, free_slots, waves, pending, cannons;
+  float Score, b1, b2, block_trans, zoom, pan;
+  double sim_time;
+  int frame_no, num_blocks;
+  unsigned rng_state;
+  unsigned char stress_mode;
+  double total_fall, game_fall_start;  // for the game's ScoreRecord
+  long event_counts[EV_TYPES];
+};
+
+const char save_magic[8] = "BSSAVE4";
+
+template <class T>
+char* save_array (char *p, const vector<T> &v)
+{
+  if (!v.empty())
+    memcpy(p, &v[0], v.size()*sizeof(T));
+  return p + v.size()*sizeof(T);
+}
+
+template <class T>
+const char* load_array (const char *p, vector<T> &v, int n)
+{
+  v.resize(n);
+  if (n)
+    memcpy(&v[0], p, n*sizeof(T));
+  return p + n*sizeof(T);
+}
+
+/* Bytes of a blob with H's counts, header included; 0 if a count is
+   negative or the total would not fit in H.size */
+unsigned long long save_size (const SaveHeader &H)
+{
+  if (H.slots < 0 || H.live < 0 || H.free_slots < 0 || H.waves < 0 || H.pending < 0 || H.cannons < 0)
+    return 0;
+  unsigned long long n = sizeof H
+    + (unsigned long long)H.slots*(sizeof(Piece) + sizeof(unsigned) + sizeof(int))
+    + ((unsigned long long)H.live + H.free_slots)*sizeof(int)
+    + (unsigned long long)H.waves*sizeof(Wave) + (unsigned long long)H.pending*sizeof(PendingSpawn)
+    + (unsigned long long)H.cannons*sizeof(Cannon);
+  return n > 0xffffffffu ? 0 : n;
+}
+
+void save_state (vector<char> &blob)
+{
+  SaveHeader H;
+  memset(&H, 0, sizeof H);
+  memcpy(H.magic, save_magic, sizeof H.magic);
+  H.slots = pool.cur.size(), H.live = pool.live.size(), H.free_slots = pool.free_slots.size();
+  H.waves = waves.size(), H.pending = pending.size(), H.cannons = num_cannons;
+  H.size = save_size(H);
+  H.Score = Score, H.b1 = b1, H.b2 = b2;
+  H.block_trans = block_trans, H.zoom = zoom, H.pan = pan;
+  H.sim_time = sim_time;
+  H.frame_no = frame_no, H.num_blocks = num_blocks;
+  H.rng_state = rng_state;
+  H.stress_mode = stress_mode;
+  H.total_fall = total_fall, H.game_fall_start = game_fall_start;
+  memcpy(H.event_counts, event_counts, sizeof H.event_counts);
+
+  blob.resize(H.size);
+  char *p = &blob[0];
+  memcpy(p, &H, sizeof H);
+  p += sizeof H;
+  p = save_array(p, pool.cur);
+  p = save_array(p, pool.gen);
+  p = save_array(p, pool.where);
+  p = save_array(p, pool.live);
+  p = save_array(p, pool.free_slots);
+  p = save_array(p, waves);
+  p = save_array(p, pending.heap());
+  memcpy(p, cannons, H.cannons*sizeof(Cannon));
+}
+
+/* What was read from a blob holds together: the live and free lists hold
+   every slot once and 'where' agrees with them, every block and pending
+   spawn names an existing wave, a block's colour indexes the colour tables
+   (0 to 2), and the clock, fall speed, wave timing and every position,
+   angle and battery line are finite numbers the game can step through */
+bool valid_save (const SaveHeader &H, const BlockPool &P, const vector<Wave> &W, const vector<PendingSpawn> &Q,
+                 const vector<Cannon> &C)
+{
+  if (!isfinite(H.sim_time) || !isfinite(H.block_trans) || H.block_trans <= 0 || !isfinite(H.Score)
+      || !isfinite(H.b1) || !isfinite(H.b2) || !isfinite(H.zoom) || !isfinite(H.pan))
+    return false;
+  int slots = P.cur.size();
+  if (P.live.size() + P.free_slots.size() != (size_t)slots)
+    return false;
+  vector<char> seen(slots, 0);
+  for(int k = 0; k < (int)P.live.size(); k++) {
+    int slot = P.live[k];
+    if (slot < 0 || slot >= slots || seen[slot]++ || P.where[slot] != k)
+      return false;
+    const Piece &B = P.cur[slot];
+    if (B.wave < 0 || B.wave >= (int)W.size() || !(B.color == 0 || B.color == 1 || B.color == 2)
+        || !isfinite(B.x1) || !isfinite(B.x2) || !isfinite(B.y1) || !isfinite(B.y2))
+      return false;
+  }
+  for(int k = 0; k < (int)P.free_slots.size(); k++) {
+    int slot = P.free_slots[k];
+    if (slot < 0 || slot >= slots || seen[slot]++ || P.where[slot] != -1)
+      return false;
+  }
+  for(int k = 0; k < (int)W.size(); k++)
+    if (!(W[k].colors & 7) || W[k].remaining < 0 || !isfinite(W[k].start) || !isfinite(W[k].next_due)
+        || !isfinite(W[k].interval) || W[k].interval < 0)
+      return false;
+  for(int k = 0; k < (int)Q.size(); k++)
+    if (Q[k].wave < 0 || Q[k].wave >= (int)W.size() || !isfinite(Q[k].due))
+      return false;
+  for(int k = 0; k < (int)C.size(); k++) {
+    const Battery &B = C[k].battery;
+    if (!isfinite(C[k].y) || !isfinite(C[k].rot) || !isfinite(B.t0) || !isfinite(B.e0)
+        || !isfinite(B.rate) || !isfinite(B.next) || B.shown < 0 || B.shown > battery_levels)
+      return false;
+  }
+  return true;
+}
+
+/* Restore from a save_state blob; false (state untouched) if it is not one
+   or does not hold together */
+bool load_state (const char *data, size_t size)
+{
+  SaveHeader H;
+  if (size < sizeof H)
+    return false;
+  memcpy(&H, data, sizeof H);
+  if (memcmp(H.magic, save_magic, sizeof H.magic) || H.size != size || save_size(H) != size
+      || H.cannons < 1 || H.cannons > max_cannons)
+    return false;
+
+  // Read into copies and check them before any of the game state changes
+  BlockPool P;
+  vector<Wave> W;
+  vector<PendingSpawn> Q;
+  vector<Cannon> C;
+  const char *p = data + sizeof H;
+  p = load_array(p, P.cur, H.slots);
+  p = load_array(p, P.gen, H.slots);
+  p = load_array(p, P.where, H.slots);
+  p = load_array(p, P.live, H.live);
+  p = load_array(p, P.free_slots, H.free_slots);
+  p = load_array(p, W, H.waves);
+  p = load_array(p, Q, H.pending);
+  p = load_array(p, C, H.cannons);
+  if (!valid_save(H, P, W, Q, C))
+    return false;
+
+  pool.cur.swap(P.cur);
+  pool.gen.swap(P.gen);
+  pool.where.swap(P.where);
+  pool.live.swap(P.live);
+  pool.free_slots.swap(P.free_slots);
+  waves.swap(W);
+  pending.heap().swap(Q);
+  num_cannons = H.cannons;
+  copy(C.begin(), C.end(), cannons);
+  schedule_batteries();
+
+  Score = H.Score, b1 = H.b1, b2 = H.b2;
+  block_trans = H.block_trans, zoom = H.zoom, pan = H.pan;
+  sim_time = H.sim_time;
+  frame_no = H.frame_no, num_blocks = H.num_blocks;
+  rng_state = H.rng_state;
+  stress_mode = H.stress_mode;
+  total_fall = H.total_fall, game_fall_start = H.game_fall_start;
+  memcpy(event_counts, H.event_counts, sizeof event_counts);
+  scored_b1 = b1, scored_b2 = b2;
+  L.clear();
+  events.clear();
+  invalidate_beam_cache();
+  return true;
+}
+
+bool save_state_file (const char *path)
+{
+  vector<char> blob;
+  save_state(blob);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Error: cannot write savestate %s\n", path);
+    return false;
+  }
+  bool ok = fwrite(&blob[0], 1, blob.size(), f) == blob.size();
+  return fclose(f) == 0 && ok;
+}
+
+/* Map the file and restore straight from the mapping */
+bool load_state_file (const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "Error: cannot read savestate %s\n", path);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Error: cannot map savestate %s\n", path);
+    return false;
+  }
+  bool ok = load_state((const char*)data, st.st_size);
+  munmap(data, st.st_size);
+  if (!ok)
+    fprintf(stderr, "Error: %s is not a savestate\n", path);
+  return ok;
+}
+
+float camera_rotation_angle = 90;
+float rectangle_rotation = 0;
+float triangle_rotation = 0;
+
+/* Render the scene with openGL */
+/* Edit this function according to your assignment */
+void draw (const RenderSnapshot &S)
+{
+  draw_calls = 0;
+  draw_vertices = 0;
+  upload_bytes = 0;
+
   // clear the color and depth n the frame buffer
   glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -859,7 +1925,8 @@ void draw ()
   //  Don't change unless you are sure!!
   Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
 
-  Matrices.projection = glm::ortho(-40.0f/zoom + pan, 40.0f/zoom + pan, -40.0f/zoom, 40.0f/zoom, 0.1f/zoom, 500.0f/zoom);
+  ViewRect V = view_rect(S.zoom, S.pan);
+  Matrices.projection = glm::ortho(V.left, V.right, V.bottom, V.top, 0.1f/S.zoom, 500.0f/S.zoom);
 
   // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
   //  Don't change unless you are sure!!
@@ -871,118 +1938,125 @@ void draw ()
   glm::mat4 MVP;  // MVP = Projection * View * Model
   glm::mat4 translatePiece, translate1, translate2; 
    glm::mat4 rotateCannons; 
-  /* Water */
-  Matrices.model = glm::mat4(1.0f);
+  /* Water, and the baskets with it, raised or lowered to the level's water line */
+  glm::mat4 waterLevel = glm::translate(glm::vec3(0, S.water_line + 37, 0));
+  Matrices.model = waterLevel;
   MVP = VP * Matrices.model;
   glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
   draw3DObject(water);
 
    /* Canon */
-  //create lazer
-  if(Shoot) {
-      for(int i = 0; i < (int)lazer.size(); i++ ) {
-        Matrices.model = glm::mat4(1.0f); 
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(lazer[i]);
-      }
+  //draw lazer
+  if(S.Shoot) {
+      Matrices.model = glm::mat4(1.0f); 
+      MVP = VP * Matrices.model;
+      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+      drawBeamBatch(S.beams);
   }
-  //draw canonbase
-  Matrices.model = glm::mat4(1.0f); 
-  translatePiece = glm::translate (glm::vec3(0, c, 0));
-  translate1 = glm::translate (glm::vec3(40, 0, 0));
-  translate2 = glm::translate (glm::vec3(-40, 0, 0));
-  rotateCannons = glm::rotate((float)(rot), glm::vec3(0,0,1));
-  Matrices.model *= translatePiece*translate2*rotateCannons*translate1; 
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(canonshooter);
-
-  Matrices.model = glm::mat4(1.0f); 
-  translatePiece = glm::translate (glm::vec3(0, c, 0));
-  translate1 = glm::translate (glm::vec3(40, 0, 0));
-  translate2 = glm::translate (glm::vec3(-40, 0, 0));
-  rotateCannons = glm::rotate((float)(rot), glm::vec3(0,0,1));
-  Matrices.model *= translatePiece*translate2*rotateCannons*translate1; 
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(canonmid);
+  for(int k = 0; k < (int)S.cannons.size(); k++) {
+    const Cannon &C = S.cannons[k];
+    //draw canonbase
+    Matrices.model = glm::mat4(1.0f); 
+    translatePiece = glm::translate (glm::vec3(0, C.y, 0));
+    translate1 = glm::translate (glm::vec3(40, 0, 0));
+    translate2 = glm::translate (glm::vec3(-40, 0, 0));
+    rotateCannons = glm::rotate((float)(C.rot), glm::vec3(0,0,1));
+    Matrices.model *= translatePiece*translate2*rotateCannons*translate1; 
+    MVP = VP * Matrices.model;
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    draw3DObject(canonshooter);
+    draw3DObject(canonmid);
   
-  //draw canonshooter
-  Matrices.model = glm::mat4(1.0f); 
-  translatePiece = glm::translate (glm::vec3(0, c, 0));
-  Matrices.model *= translatePiece; 
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(canonbase);
+    //draw canonshooter
+    Matrices.model = glm::mat4(1.0f); 
+    translatePiece = glm::translate (glm::vec3(0, C.y, 0));
+    Matrices.model *= translatePiece; 
+    MVP = VP * Matrices.model;
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    draw3DObject(canonbase);
+  }
 
   //draw basket 1
-  Matrices.model = glm::mat4(1.0f); 
-  translatePiece = glm::translate (glm::vec3(b1, 0, 0));
+  Matrices.model = waterLevel;
+  translatePiece = glm::translate (glm::vec3(S.b1, 0, 0));
   Matrices.model *= translatePiece; 
   MVP = VP * Matrices.model;
   glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
   draw3DObject(basket1);
 
   //draw basket 2
-  Matrices.model = glm::mat4(1.0f);
-  translatePiece = glm::translate (glm::vec3(b2, 0, 0));
+  Matrices.model = waterLevel;
+  translatePiece = glm::translate (glm::vec3(S.b2, 0, 0));
   Matrices.model *= translatePiece; 
   MVP = VP * Matrices.model;
   glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
   draw3DObject(basket2);
 
 
-  //mirror1
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(mirror1);
-
-  //mirror2
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(mirror2);
-
-  //mirror3
+  //mirrors
   Matrices.model = glm::mat4(1.0f);
   MVP = VP * Matrices.model;
   glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(mirror3);
+  drawMirrorBatch(S.mirrors);
 
 
-  for(int i = 1; i <= 20; i++) { 
-    Matrices.model = glm::mat4(1.0f);  
-    translatePiece = glm::translate (glm::vec3(0, current[i].trans, 0));
-    Matrices.model *= translatePiece;
+  // Only blocks inside the ortho window go to the GPU
+  cull_blocks(S.blocks, V);
+  if(batch_blocks) {
+    Matrices.model = glm::mat4(1.0f);
     MVP = VP * Matrices.model;
     glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    draw3DObject(box[i]);
-    current[i].y1 -= block_trans;
-    current[i].y2 -= block_trans;
-    //translating pieces 
-    current[i].trans -= block_trans;
+    drawBlockBatch(S.blocks);
   }
-  //battery
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(battery);
-
-
-  //battery_cell
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(battery_cell);
+  else {
+    for(int n = 0; n < (int)visible_blocks.size(); n++) { 
+      const Piece &P = S.blocks[visible_blocks[n]];
+      Matrices.model = glm::mat4(1.0f);  
+      translatePiece = glm::translate (glm::vec3(P.x1, P.y1, 0));
+      Matrices.model *= translatePiece;
+      MVP = VP * Matrices.model;
+      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+      draw3DObject(block_quad[(int)P.color]);
+    }
+  }
+  //one battery per cannon, in rows from the top left corner. A gauge is
+  //9 x 5 units with its gap; past 5 cannons the rows get longer and the
+  //gauges shrink so all 64 stay left of the HUD text (49 units across)
+  const int gauges = S.cannons.size();
+  const int per_row = max(5, (int)ceil(sqrt(4.0f*gauges)));
+  const float gauge_scale = min(1.0f, 49.0f / (9.0f*per_row));
+  for(int k = 0; k < gauges; k++) {
+    glm::mat4 stack = glm::translate(glm::vec3(-37, 37, 0))
+                    * glm::scale(glm::vec3(gauge_scale, gauge_scale, 1))
+                    * glm::translate(glm::vec3(37 + 9.0f*(k % per_row), -37 - 5.0f*(k / per_row), 0));
+    //battery and battery_cell
+    Matrices.model = stack;
+    MVP = VP * Matrices.model;
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    draw3DObject(battery);
+    draw3DObject(battery_cell);
 
+    //battery_power, squeezed towards Pix to the current charge
+    Matrices.model = stack * glm::translate(glm::vec3(Pix, 0, 0))
+                   * glm::scale(glm::vec3((float)S.cannons[k].battery.shown / battery_levels, 1, 1))
+                   * glm::translate(glm::vec3(-Pix, 0, 0));
+    MVP = VP * Matrices.model;
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    draw3DObject(battery_power);
+  }
 
-  //battery_power
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(battery_power);
+  //HUD: score, frame rate, fall speed and player one's battery
+  char text[hud_line_chars + 1];
+  snprintf(text, sizeof text, "SCORE %g", S.score);
+  hud_line(0, text, 14, 38.5, 0, 0, 0);
+  snprintf(text, sizeof text, "FPS %d", hud_fps());
+  hud_line(1, text, 14, 36, 0, 0, 0);
+  snprintf(text, sizeof text, "SPEED %.2f", S.speed);
+  hud_line(2, text, 14, 33.5, 0, 0, 0);
+  snprintf(text, sizeof text, "BATTERY %d%%", S.cannons[0].battery.shown * 100 / battery_levels);
+  hud_line(3, text, 14, 31, 0, 0, 0);
+  drawHud();
+  drawPerfOverlay(S);
 
   // Increment angles
   float increments = 1;
@@ -999,6 +2073,7 @@ void scroll_callback(GLFWwindow*, double, double);
 GLFWwindow* initGLFW (int width, int height)
 {
     GLFWwindow* window; // window desciptor/handle
+    double t = startup_clock();
 
     glfwSetErrorCallback(error_callback);
     if (!glfwInit()) {
@@ -1018,7 +2093,11 @@ GLFWwindow* initGLFW (int width, int height)
     }
 
     glfwMakeContextCurrent(window);
-    gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+    startup_phase("window and GL context", t);
+    t = startup_clock();
+    if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
+      fprintf(stderr, "Error: cannot load the GL entry points\n");
+    startup_phase("GL loader", t);
     glfwSwapInterval( 1 );
     glfwSetScrollCallback(window, scroll_callback);
 
@@ -1046,13 +2125,17 @@ GLFWwindow* initGLFW (int width, int height)
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
 {
+  // GL_TRACE builds count every GL call from here on
+  gl_trace_install();
+  double t = startup_clock();
+
     /* Objects should be created before any other gl function and shaders */
   
   // Create the models
   //creating the pieces of the game 
-  for(int i = 1; i <= 20; i++) { 
-    createPieces(i);
-  }
+  createBlockQuads();
+  createBeamBatch();
+  reset_game();
   createBattery();
   createWater();
   //creating the baskets at the bottom
@@ -1062,13 +2145,20 @@ void initGL (GLFWwindow* window, int width, int height)
   //creating canon
   createCanon();
   //the lazer from the cannon
+  startup_phase("game and geometry", t);
+  t = startup_clock();
   // Create and compile our GLSL program from the shaders
   programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
   // Get a handle for our "MVP" uniform
   Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+  createHud();
+  createPerfOverlay();
+  startup_phase("shaders, font and overlay", t);
 
   
-  reshapeWindow (window, width, height);
+  // Offscreen tools have no window and set their own viewport
+  if (window)
+    reshapeWindow (window, width, height);
 
   // Background color of the scene
   glClearColor (1.0f, 1.0f, 1.0f, 1.0f); // R, G, B, A
@@ -1091,189 +2181,342 @@ void translate_() {
   if(pressed[GLFW_KEY_N]) block_trans+=0.02;
   if(pressed[GLFW_KEY_M] && block_trans > 0.05) block_trans-=0.02;
   if(pressed[GLFW_KEY_LEFT_CONTROL] && pressed[GLFW_KEY_LEFT]) {
-    if(b1 >= -32) {
-      b1-= 0.3;
+    if(b1 >= level->basket_min[0]) {
+      b1-= level->basket_step;
     }
   }
   else if(pressed[GLFW_KEY_LEFT_CONTROL] && pressed[GLFW_KEY_RIGHT]) {
-    if(b1 <= 46) {
-      b1+= 0.3;
+    if(b1 <= level->basket_max[0]) {
+      b1+= level->basket_step;
     }
   }
   else if(pressed[GLFW_KEY_LEFT_ALT] && pressed[GLFW_KEY_LEFT]) {
-    if(b2 >= -46) {
-      b2-= 0.3;
+    if(b2 >= level->basket_min[1]) {
+      b2-= level->basket_step;
     }
   }
   else if(pressed[GLFW_KEY_LEFT_ALT] && pressed[GLFW_KEY_RIGHT]) {
-    if(b2 <= 32) {
-      b2+= 0.3;
+    if(b2 <= level->basket_max[1]) {
+      b2+= level->basket_step;
     }
   } 
 
   if(pressed[GLFW_KEY_S]) { 
-    if(c <= 37) {
-      c+=0.3;
+    if(c <= level->cannon_max) {
+      c+=level->cannon_step;
     }
   }
   else if(pressed[GLFW_KEY_F]) { 
-    if(c >= -37) {
-      c-= 0.3;
+    if(c >= level->cannon_min) {
+      c-= level->cannon_step;
     }
   }
 }
 
 void rotate_canon()  { 
   if(pressed[GLFW_KEY_A]) { 
-    if(2*rot < M_PI) {
-      rot+=0.03;
+    if(rot < level->turn_limit) {
+      rot+=level->turn_step;
     }
   }
   else if(pressed[GLFW_KEY_D]) {
-    if(2*rot > -M_PI) {
-      rot-=0.03;
+    if(rot > -level->turn_limit) {
+      rot-=level->turn_step;
     }
   }
 }
 
+/* Player two drives cannon 1: I / K move it, J / L turn it, ENTER fires.
+   Cannons past that swing their aim up and down on their own and always fire, so a
+   stress run can put many beams on the board without input. */
+void control_cannons()  {
+  if(num_cannons > 1) {
+    Cannon &C = cannons[1];
+    if(pressed[GLFW_KEY_I] && C.y <= level->cannon_max) C.y += level->cannon_step;
+    else if(pressed[GLFW_KEY_K] && C.y >= level->cannon_min) C.y -= level->cannon_step;
+    if(pressed[GLFW_KEY_J] && C.rot < level->turn_limit) C.rot += level->turn_step;
+    else if(pressed[GLFW_KEY_L] && C.rot > -level->turn_limit) C.rot -= level->turn_step;
+    C.firing = pressed[GLFW_KEY_ENTER];
+  }
+  for(int k = 2; k < num_cannons; k++) {
+    Cannon &C = cannons[k];
+    C.rot = 0.8f * level->turn_limit * sin(0.02f * frame_no + k);
+    C.firing = true;
+  }
+}
+
+/* Wheel clicks not yet latched by the simulation, and those latched for
+   the current tick */
+atomic<int> scroll_steps(0);
+int tick_scroll = 0;
+
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
-  if(yoffset == 1 && zoom < 1.5) {
-    zoom += 0.01;
-  }
-  else if(yoffset == -1 && zoom > 1) {
-    zoom -= 0.01;
+  if(yoffset == 1 || yoffset == -1)
+    scroll_steps += (int)yoffset;
+}
+
+void apply_scroll() {
+  for(int steps = tick_scroll; steps != 0; steps -= (steps > 0 ? 1 : -1)) {
+    if(steps > 0 && zoom < 1.5) {
+      zoom += 0.01;
+    }
+    else if(steps < 0 && zoom > 1) {
+      zoom -= 0.01;
+    }
   }
 }
 
 int a = 0;
-void checkhit(int j) {
-  int i, k;
-
-  // cout << "in checkhit - start" << endl;
-  // for(k = 0; k < (int)L.size(); k++) {
-  //   cout << L[k].x1 << ' ' << L[k].x2 << endl;
-  // }
-  // cout << "in checkhit - end" << endl;
-  int r;
-  //cout << j << endl;
-  float x1 = L[j].x1, y1 = L[j].y1, ang = L[j].ang;
-  float x2 = L[j].x2, y2 = L[j].y2;
-  for(int i = 1; i <= 20; i++) {
-      // float y = (current[i].x1 - x1)*tan(ang) + y1;
-      // if((y >= current[i].y1) && (y <= (current[i].y1 + 3)) && (current[i].y1 <= 40) && (current[i].y1 >= -40)) { 
-      //   if(current[i].x1 >= min(L[j].x1, L[j].x2) && current[i].x1 <= max(L[j].x1, L[j].x2)) {
-          
-          float y = (current[i].x1 - L[j].x1) * tan(ang) + L[j].y1;
-          if(y >= min(current[i].y1, current[i].y2) && y <= max(current[i].y1, current[i].y2) && current[i].x1 >= min(L[j].x1, L[j].x2) && current[i].x1 <= max(L[j].x1, L[j].x2) ) {   
-            //cout << x1 << ' ' << x2 << ' ' << endl;
-            // cout << j << ' ' << L.size() << endl;
-            // cout << x1 << ' ' << current[i].x1 << ' ' << x2 << endl;
-            //cout << "hit" << endl;
-            // cout << "info" << endl;
-            // cout << L.size() << endl;
-            // cout << a << endl;
-            // cout << L[j].x1 << ' ' << L[j].x2 << " " << j << endl;
-            //cout << "hit done" << endl;
-            if( (L.size() == 1 && x1 == -40 && x2 == 500) || L.size() >= 2)
-              { 
-                if(current[i].color == 2) {
-                  Score += 100;
-                }
-                else 
-                {
-                  Score -= 10;
-                }
-                createPieces(i);
-              }
-        }
-      }
-  return ;
+/* Score and remove one piece the beam went through */
+void beam_hit(int i) {
+  const Piece &P = pool.cur[i];
+  if(P.color == 2) {
+    emit_event(EV_HIT, P.color, level->score_black_shot, P.x1, P.y1);
+  }
+  else 
+  {
+    emit_event(EV_HIT, P.color, level->score_other_shot, P.x1, P.y1);
+  }
+  remove_block(i);
 }
 
-#define FF pair<float, float> 
+/* Live pieces as SoA boxes for the slab test, each grown by 'grow' on
+   every side, stretched down by 'below' and up by 'above' */
+struct BeamTargets {
+  vector<float> x1, y1, x2, y2;
+  vector<int> slot;
+  vector<unsigned> gen;
+  vector<unsigned> mask;    // slab_test result, bit per box
+} targets;
+
+void gather_targets(float grow, float below, float above) {
+  int n = pool.size();
+  targets.x1.resize(n), targets.y1.resize(n), targets.x2.resize(n), targets.y2.resize(n);
+  targets.slot.resize(n), targets.gen.resize(n);
+  targets.mask.resize((n + 31) / 32);
+  for(int k = 0; k < n; k++) {
+    int i = pool.live[k];
+    const Piece &P = pool.cur[i];
+    targets.x1[k] = P.x1 - grow, targets.x2[k] = P.x2 + grow;
+    targets.y1[k] = P.y1 - below - grow, targets.y2[k] = P.y2 + above + grow;
+    targets.slot[k] = i, targets.gen[k] = pool.gen[i];
+  }
+}
 
-FF solve_lines(float a1, float b1, float c1, float a2, float b2, float c2) { 
-  return {(c2*b1-b2*c1)/(a2*b1-a1*b2), (c1*a2-a1*c2)/(a2*b1-a1*b2)};
+/* Start a beam pass: shoot() before the mirrors (no sweep), recheck_beam()
+   after the pieces moved, boxes swept up by the distance they fell so fast
+   pieces cannot tunnel through the beam. Also drops spawn_log entries
+   every cache has taken in. */
+void begin_beam_pass(float sweep = 0) {
+  pass_sweep = sweep;
+  size_t done = spawn_log.size();
+  for(int k = 0; k < (int)seg_cache.size(); k++)
+    done = min(done, seg_cache[k].spawn_mark);
+  spawn_log.erase(spawn_log.begin(), spawn_log.begin() + done);
+  for(int k = 0; k < (int)seg_cache.size(); k++)
+    seg_cache[k].spawn_mark -= done;
+}
+
+inline bool near_point(float x1, float y1, float x2, float y2) {
+  return fabs(x1 - x2) <= beam_tolerance && fabs(y1 - y2) <= beam_tolerance;
+}
+
+/* Full query: every live piece against segment S */
+void query_segment(SegmentCache &C, const Lazer &S) {
+  C.seg = S;
+  C.fall_mark = total_fall;
+  C.speed = max(block_trans, pass_sweep);
+  C.spawn_mark = spawn_log.size();
+  C.candidates.clear();
+  gather_targets(beam_tolerance, cache_fall, C.speed);
+  const SlabRay r = slab_ray(S.x1, S.y1, S.x2, S.y2);
+  const int n = targets.slot.size();
+  if(jobs.workers() > 1 && n > 2*job_grain) {
+    jobs.parallel_for(0, (n + 31) / 32, job_grain / 32, [&r, n](int begin, int end) {
+      slab_test(targets.x1.data(), targets.y1.data(), targets.x2.data(), targets.y2.data(),
+                begin * 32, min(n, end * 32), r, targets.mask.data());
+    });
+  }
+  else
+    slab_test(targets.x1.data(), targets.y1.data(), targets.x2.data(), targets.y2.data(),
+              0, n, r, targets.mask.data());
+  for(int w = 0; w < (int)targets.mask.size(); w++)
+    for(unsigned bits = targets.mask[w]; bits; bits &= bits - 1) {
+      int k = w * 32 + __builtin_ctz(bits);
+      C.candidates.push_back((BlockHandle){targets.slot[k], targets.gen[k]});
+    }
+  cache_queries++;
+}
+
+/* Cache entry whose candidates cover segment S, re-queried if none does */
+SegmentCache& segment_candidates(const Lazer &S) {
+  static SegmentCache uncached;
+  if(!beam_cache) {
+    query_segment(uncached, S);
+    return uncached;
+  }
+  int pick = -1;
+  for(int k = 0; k < (int)seg_cache.size(); k++) {
+    SegmentCache &C = seg_cache[k];
+    if(near_point(C.seg.x1, C.seg.y1, S.x1, S.y1) && near_point(C.seg.x2, C.seg.y2, S.x2, S.y2)
+       && total_fall - C.fall_mark <= cache_fall && max(block_trans, pass_sweep) <= C.speed) {
+      // Take in the pieces spawned since; those out of reach are dropped at the next query
+      for(; C.spawn_mark < spawn_log.size(); C.spawn_mark++)
+        C.candidates.push_back(spawn_log[C.spawn_mark]);
+      C.used = ++cache_clock;
+      cache_reuses++;
+      return C;
+    }
+    if(pick < 0 || C.used < seg_cache[pick].used)
+      pick = k;
+  }
+  if((int)seg_cache.size() < max_cached_segments) {
+    seg_cache.push_back(SegmentCache());
+    pick = seg_cache.size() - 1;
+  }
+  SegmentCache &C = seg_cache[pick];
+  query_segment(C, S);
+  C.used = ++cache_clock;
+  return C;
+}
+
+/* Whole-box hit test of beam segment j */
+void checkhit(int j) {
+  const Lazer S = L[j];
+  // Only the straight shot or a reflected beam scores
+  if(!((L.size() == 1 && S.x1 == -40 && S.x2 == 500) || L.size() >= 2))
+    return;
+  SegmentCache &C = segment_candidates(S);
+  const SlabRay r = slab_ray(S.x1, S.y1, S.x2, S.y2);
+  int kept = 0;
+  for(int k = 0; k < (int)C.candidates.size(); k++) {
+    BlockHandle h = C.candidates[k];
+    if(!pool.valid(h))
+      continue; // shot or scored since; forget it
+    const Piece &P = pool.cur[h.slot];
+    if(slab_hit(r, P.x1, P.y1, P.x2, P.y2 + pass_sweep))
+      beam_hit(h.slot);
+    else
+      C.candidates[kept++] = h;
+  }
+  C.candidates.resize(kept);
+}
+
+/* A beam reflects off at most this many mirrors, each at most once */
+const int max_bounces = 32;
+const float beam_reach = 1500;  // length of a reflected segment, well past the view
+
+/* Where beam segment S first meets a mirror not in 'used' (BVH, nearest
+   hit along S): S cut there, and the reflection about the mirror's angle.
+   Returns the mirror, or -1 if S reaches none. */
+int nextBounce(const Lazer &S, const int *used, int nused, Lazer &cut, Lazer &reflected) {
+  float dx = S.x2 - S.x1, dy = S.y2 - S.y1, t;
+  int i = mirror_bvh.nearest(S.x1, S.y1, dx, dy, 1, used, nused, t);
+  if(i < 0)
+    return -1;
+  const LevelMirror &M = level_mirrors(level)[i];
+  float x = S.x1 + t*dx, y = S.y1 + t*dy;
+  float len = hypot(dx, dy);
+  dx /= len, dy /= len;
+  float ux = cos(M.angle), uy = sin(M.angle);
+  float along = dx*ux + dy*uy;
+  float rx = 2*along*ux - dx, ry = 2*along*uy - dy;
+  cut = (Lazer){S.x1, S.y1, S.ang, x, y};
+  reflected = (Lazer){x, y, (float)atan2(ry, rx), x + beam_reach*rx, y + beam_reach*ry};
+  return i;
 }
 
 int k = 1;
+/* Bounce every beam in L (one primary per firing cannon) off the mirrors,
+   scoring the pieces each reflected segment goes through before it is cut
+   at the next mirror. The beams are traced interleaved, one bounce of
+   each per round, but every bounce is still its own nearest-mirror query
+   on the BVH: nothing is shared between beams. Mirrors in 's' are left
+   out. */
 void LazerWithMirror(set<int> s) {
-  for(int i = 1; i <= 3; i++) {
-      if(s.count(i) == 1) continue;
-      float A = -tan(L[L.size()-1].ang);
-      float B = 1;
-      float C = L[L.size()-1].y1 + A*L[L.size()-1].x1;
-      FF t = solve_lines(m[i].a, m[i].b, m[i].c, A, B, C); 
-      float x = t.first;
-      float y = t.second;
-      if( x >= min(m[i].x1, m[i].x2) && x <= max(m[i].x2, m[i].x1) )  {
-          float ang_reflected = 2*m[i].angle - L[L.size()-1].ang;
-          if(2*m[i].angle > M_PI) {
-            ang_reflected -= M_PI;          
-          }
-          float X = L[L.size()-1].x1, Y = L[L.size()-1].y1, ANG = L[L.size()-1].ang;
-          lazer.pop_back();
-          L.pop_back();
-          createNewLazer(X, Y, ANG, x, y); //for the incident lazer
-          lazer.push_back(Laz);
-          L.push_back((Lazer){X, Y, ANG, x, y});
-          checkhit(L.size()-1);
-          if(2*m[i].angle > M_PI) {
-            float yy = (tan(ang_reflected) * (-700-x)) + y; 
-            createNewLazer(x, y, ang_reflected, -700.0f, yy); //for the reflected lazer
-          }
-          else if(ang_reflected  < 0) {
-            createNewLazer(x, y, ang_reflected, 800.0f, (800.0f-x)*tan(ang_reflected) +y );
-          } 
-          else {
-            createNewLazer(x, y, ang_reflected);
-          }
-          L.push_back((Lazer){x, y, ang_reflected, tempx, tempy});
-          lazer.push_back(Laz);
-          // cout << L.size() << endl;
-          // cout << "start" << endl;
-          // for(int i = 0; i < L.size(); i++) {
-          //   cout << L[i].x1 << ' ' << L[i].x2 << endl;
-          // }
-
-          // cout << "end" << endl;
-          //cout << L.size() << endl;
-          a++;
-          checkhit(L.size()-1);
-          s.insert(i);
-          LazerWithMirror(s);
-          s.erase(i);
-          break;
-        }
+  static vector<int> tip, used;   // per beam: its last segment, mirrors it hit
+  const int beams = L.size(), nskip = s.size(), stride = nskip + max_bounces;
+  tip.resize(beams);
+  used.resize(beams * stride);
+  for(int j = 0; j < beams; j++) {
+    tip[j] = j;
+    copy(s.begin(), s.end(), used.begin() + j*stride);
+  }
+  for(int bounce = 0, live = beams; bounce < max_bounces && live; bounce++) {
+    live = 0;
+    for(int j = 0; j < beams; j++) {
+      if(tip[j] < 0)
+        continue;
+      Lazer cut, reflected;
+      int i = nextBounce(L[tip[j]], &used[j*stride], nskip + bounce, cut, reflected);
+      if(i < 0) {
+        tip[j] = -1;
+        continue;
+      }
+      L[tip[j]] = cut;
+      tip[j] = L.size();
+      L.push_back(reflected);
+      used[j*stride + nskip + bounce] = i;
+      a++;
+      live++;
+      checkhit(tip[j]);
     }
+  }
 }
 
-void shoot() { 
-  if(pressed[GLFW_KEY_SPACE]) Shoot = true;
-  else { 
-    Shoot = false;
-    lazer.clear();
-    L.clear();
-  }
-  if(Shoot && (Pfx > Pix) ) {
-    if(Pfx >= Pix) Pfx -= 0.07;
-    if(Pfx <= Pix) return ;
-    xi = -40;
-    yi = c;
-    // L.clear();
-    // lazer.clear();
-    createLazer();
-    lazer.push_back(Laz);
-    L.push_back((Lazer){-40, c, rot, 500, 540*tan(rot) + c});
+/* Every cannon with its trigger held and charge left fires. Pressing or
+   releasing a trigger turns its battery's drain on or off; that is the
+   only battery work here. The primaries are scored whole, then traced
+   off the mirrors. A click in the play area holds cannon 0's trigger like the
+   space bar (shoot_mouse has aimed it at the cursor by then). */
+bool mouse_trigger = false;
 
-    set<int> s;
-    checkhit(0);
-    LazerWithMirror(s);
+void shoot() { 
+  Shoot = pressed[GLFW_KEY_SPACE] || mouse_trigger;
+  bool changed = false;
+  for(int k = 0; k < num_cannons; k++) {
+    Cannon &C = cannons[k];
+    if(C.firing != battery_draining(C.battery)) {
+      battery_set_drain(C.battery, sim_time, C.firing);
+      changed = true;
+    }
+    if(!C.firing || battery_charge(C.battery, sim_time) <= 0)
+      continue;
+    L.push_back((Lazer){-40, C.y, C.rot, 500, 540*tan(C.rot) + C.y});
   }
+  if(changed)
+    schedule_batteries();
+  if(L.empty())
+    return;
+  xi = -40;
+  yi = c;
+  begin_beam_pass();
+  for(int j = 0; j < (int)L.size(); j++)
+    checkhit(j);
+  LazerWithMirror(set<int>());
 }
 
 GLFWwindow *Window;
+
+/* Cursor position in window pixels. glfwGetCursorPos may only be called on
+   the main thread, so it samples after every poll; the simulation reads the
+   position latched for the tick. */
+atomic<double> cursor_x(0), cursor_y(0);
+double tick_cursor_x = 0, tick_cursor_y = 0;
+
+void update_cursor() {
+  double x = 0, y = 0;
+  if(Window)
+    glfwGetCursorPos(Window, &x, &y);
+  cursor_x = x;
+  cursor_y = y;
+}
+
+void getCursorPos(double *x, double *y) {
+  *x = tick_cursor_x;
+  *y = tick_cursor_y;
+}
 float prevx2= 6, prevx1 = -6;
 bool block1 = false;
 bool block2 = false;
@@ -1281,7 +2524,7 @@ bool canon = false;
 
 void MouseControl_baskets() {
   double currx, curry;
-  glfwGetCursorPos(Window, &currx, &curry);
+  getCursorPos(&currx, &curry);
   currx = (currx*2*40/600) - 40.0;
   curry = 40.0 - (curry*2*40/600);
   if(Clicked) {
@@ -1302,12 +2545,13 @@ void MouseControl_baskets() {
 
 void checkblock() { 
   double mousex, mousey;
-  glfwGetCursorPos(Window, &mousex, &mousey); 
+  getCursorPos(&mousex, &mousey);
   mousex = (mousex*2*40/600) - 40.0;
   mousey = 40.0-(mousey*2*40/600);
   //check for basket1
   double currx = mousex, curry = mousey;
  
+  curry -= level->water_line + 37; // baskets ride the water line
   if(currx <= b2 + 10 && currx >= b2 + 5 && curry >= -43 && curry <= -35)
     block2 = true;
   else if(currx >= b1-10 && currx <= b1-5 && curry >= -43 && curry <= -35)
@@ -1318,7 +2562,7 @@ double prevy = c;
 
 void MouseControl_canon() {
   double currx, curry;
-  glfwGetCursorPos(Window, &currx, &curry);
+  getCursorPos(&currx, &curry);
   currx = (currx*2*40/600) - 40.0;
   curry = 40.0 - (curry*2*40/600);
   if(Clicked) {
@@ -1336,7 +2580,7 @@ void MouseControl_canon() {
 
 void checkcanon() { 
   double mousex, mousey;
-  glfwGetCursorPos(Window, &mousex, &mousey); 
+  getCursorPos(&mousex, &mousey);
   mousex = (mousex*2*40/600) - 40.0;
   mousey = 40.0-(mousey*2*40/600);
   //check for basket1
@@ -1347,55 +2591,602 @@ void checkcanon() {
   }
 }
 
+/* Aim cannon 0 at a click in the play area and hold its trigger for this
+   tick; the shot itself is shoot()'s */
 void shoot_mouse() {
   double mousex, mousey;
-  glfwGetCursorPos(Window, &mousex, &mousey); 
+  getCursorPos(&mousex, &mousey);
   mousex = (mousex*2*40/600) - 40.0;
   mousey = 40.0-(mousey*2*40/600);
   float slope = (mousey-c)/(mousex+40);
-  if(Clicked && mousex >= -30 && mousey >= -34) {
-    Shoot = true;
+  mouse_trigger = Clicked && mousex >= -30 && mousey >= -34;
+  if(mouse_trigger)
     rot = atan(slope);
-    createNewLazer(c, -40, atan(slope), mousex, mousey);
-    lazer.push_back(Laz);
-    L.push_back((Lazer){-40, c, atan(slope), mousex, mousey});
+}
+
+enum { STAYS, BLACK_IN_WATER, CAUGHT, LOST };
+
+/* What happens to piece P this tick. A piece that crossed the water line
+   is judged against the baskets where they were at the moment it crossed,
+   interpolated over the tick, not where they ended up. */
+inline int classify_block(const Piece &P) {
+  if(P.y1 > level->water_line)
+    return STAYS;
+  if(P.color == 2)
+    return BLACK_IN_WATER;
+  float t = block_trans > 0 ? (P.y1 + block_trans - level->water_line) / block_trans : 1;
+  t = min(1.0f, max(0.0f, t));
+  float B1 = scored_b1 + (b1 - scored_b1) * t;
+  float B2 = scored_b2 + (b2 - scored_b2) * t;
+  if(P.color == 0 && P.x1 <= B1 - 2.5 && P.x1 >= B1 - 12.5)
+    return CAUGHT;
+  if(P.color == 1 && P.x1 >= B2 + 2.5 && P.x1 <= B2 + 12.5)
+    return CAUGHT;
+  return LOST;
+}
+
+/* Apply a non-STAYS outcome. Returns true on game over. */
+bool resolve_block(int i, int outcome) {
+  const Piece &P = pool.cur[i];
+  if(outcome == BLACK_IN_WATER) {
+    // Stress runs are for load, not for losing in the first second
+    emit_event(EV_BLACK_WATER, P.color, stress_mode ? level->score_black_water : 0, P.x1, P.y1);
+    if(!stress_mode)
+      return true;
   }
+  else if(outcome == CAUGHT)
+    emit_event(EV_CATCH, P.color, level->score_caught, P.x1, P.y1);
+  else
+    emit_event(EV_MISS, P.color, 0, P.x1, P.y1);
+  remove_block(i);
+  return false;
 }
-int main (int argc, char** argv)
-{ 
+
+bool scan_blocks() {
+  if(jobs.workers() > 1 && pool.size() > 2*job_grain) {
+    // Classify in parallel, resolve here in live order
+    static vector<char> outcome;
+    static vector<int> resolve_slots;
+    outcome.resize(pool.size());
+    jobs.parallel_for(0, pool.size(), job_grain, [](int begin, int end) {
+      for(int n = begin; n < end; n++)
+        outcome[n] = classify_block(pool.cur[pool.live[n]]);
+    });
+    resolve_slots.clear();
+    for(int n = 0; n < (int)outcome.size(); n++)
+      if(outcome[n] != STAYS)
+        resolve_slots.push_back(pool.live[n]);
+    for(int k = 0; k < (int)resolve_slots.size(); k++)
+      if(resolve_block(resolve_slots[k], classify_block(pool.cur[resolve_slots[k]])))
+        return true;
+    return false;
+  }
+  for(int n = 0; n < pool.size(); n++) { 
+    int i = pool.live[n];
+    int outcome = classify_block(pool.cur[i]);
+    if(outcome != STAYS) {
+      if(resolve_block(i, outcome))
+        return true;
+      n--;
+    }
+  }
+  return false;
+}
+
+/* Water/basket scan after the pieces moved. Returns true on game over. */
+bool score_blocks() {
+  if (spawner_idle())
+    return true; // every scripted wave is cleared
+  bool over = scan_blocks();
+  scored_b1 = b1, scored_b2 = b2;
+  return over;
+}
+
+/* Move the battery gauges that reached their next step. Between steps
+   this is one comparison per tick. */
+void update_batteries() {
+  if(sim_time < battery_due)
+    return;
+  for(int k = 0; k < num_cannons; k++)
+    if(sim_time >= cannons[k].battery.next)
+      battery_schedule(cannons[k].battery, sim_time);
+  schedule_batteries();
+}
+
+/* Test the beam again against the pieces at their new positions, swept
+   over the distance they just fell */
+void recheck_beam() {
+  if(any_firing()) {
+    begin_beam_pass(block_trans);
+    for(int i = 0; i < (int)L.size(); i++) {
+      checkhit(i);
+    }
+  }
+}
+
+/* F5 quicksaves to quick.save, F9 loads it back (on key press). Not while
+   recording: a session cannot replay a load. */
+void savestate_keys() {
+  static bool was_save = false, was_load = false;
+  if(record_file)
+    return;
+  bool save = pressed[GLFW_KEY_F5], load = pressed[GLFW_KEY_F9];
+  if(save && !was_save && save_state_file("quick.save"))
+    cout << "Saved quick.save" << endl;
+  if(load && !was_load && load_state_file("quick.save"))
+    cout << "Loaded quick.save" << endl;
+  was_save = save, was_load = load;
+}
+
+/* The keys the simulation reads; latch_input copies (and records) these */
+const int sim_keys[] = {
+  GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_UP, GLFW_KEY_DOWN, GLFW_KEY_N, GLFW_KEY_M,
+  GLFW_KEY_LEFT_CONTROL, GLFW_KEY_LEFT_ALT, GLFW_KEY_S, GLFW_KEY_F, GLFW_KEY_A, GLFW_KEY_D,
+  GLFW_KEY_I, GLFW_KEY_K, GLFW_KEY_J, GLFW_KEY_L, GLFW_KEY_ENTER, GLFW_KEY_SPACE,
+  GLFW_KEY_F5, GLFW_KEY_F9
+};
+
+/* Take this tick's input from what the callbacks left. Changes go to the
+   recording stamped with the tick that sees them first; the cursor only
+   when a press or a held button makes the simulation read it. */
+void latch_input() {
+  for(int n = 0; n < (int)(sizeof sim_keys / sizeof *sim_keys); n++) {
+    int key = sim_keys[n];
+    bool down = key_down[key];
+    if(down != pressed[key] && record_file)
+      fprintf(record_file, "%d %d %d\n", session_tick, key, down);
+    pressed[key] = down;
+  }
+  bool held = button_down, click = click_pending.exchange(false);
+  double x = cursor_x, y = cursor_y;
+  bool moved = x != tick_cursor_x || y != tick_cursor_y;
+  if(record_file && (click || held != Clicked || (held && moved)))
+    fprintf(record_file, "mouse %d %.17g %.17g %d %d\n", session_tick, x, y, held, click);
+  Clicked = held;
+  tick_click = click;
+  tick_cursor_x = x, tick_cursor_y = y;
+  tick_scroll = scroll_steps.exchange(0);
+  if(record_file && tick_scroll)
+    fprintf(record_file, "scroll %d %d\n", session_tick, tick_scroll);
+}
+
+/* Drop all input, raw and latched, and any drag in progress */
+void clear_input() {
+  for(int k = 0; k < 10000; k++)
+    key_down[k] = pressed[k] = false;
+  button_down = click_pending = Clicked = tick_click = false;
+  cursor_x = cursor_y = tick_cursor_x = tick_cursor_y = 0;
+  scroll_steps = tick_scroll = 0;
+  block1 = block2 = canon = false;
+  prevx1 = -6, prevx2 = 6, prevy = c;
+}
+
+/* Session recording (--record): the options a replay needs, then the
+   input latch_input() writes, one line per change:
+     <tick> <key> <1 down|0 up>
+     mouse <tick> <x> <y> <button held> <pressed since the last tick>
+     scroll <tick> <wheel steps>
+   A path the session cannot hold (a space in it) is refused. Level hot
+   reload and F5/F9 savestates are off while recording, since a replay
+   could not follow them. */
+bool start_recording (const char* path, const char* load_path)
+{
+  const char *files[] = { level_path, waves_path, load_path };
+  for (int n = 0; n < 3; n++)
+    if (files[n] && (strpbrk(files[n], " \t\n") || strlen(files[n]) > 255)) {
+      fprintf(stderr, "Error: cannot record with %s: a session holds paths up to 255 characters without spaces\n", files[n]);
+      return false;
+    }
+  record_file = fopen(path, "w");
+  if (!record_file) {
+    fprintf(stderr, "Error: cannot write session %s\n", path);
+    return false;
+  }
+  fprintf(record_file, "# block-shooter session v2: <tick> <key> <1 down|0 up>, latched at the start of <tick>\n");
+  fprintf(record_file, "seed %u\n", game_seed);
+  if (num_cannons > 1)
+    fprintf(record_file, "cannons %d\n", num_cannons);
+  if (level_path)
+    fprintf(record_file, "level %s\n", level_path);
+  if (waves_path)
+    fprintf(record_file, "waves %s\n", waves_path);
+  if (stress_mode)
+    fprintf(record_file, "stress %d\n", num_blocks);
+  if (job_threads > 0)
+    fprintf(record_file, "jobs %d\n", job_threads);
+  if (load_path)
+    fprintf(record_file, "load %s\n", load_path);
+  session_tick = 0;
+  cout << "Recording " << path << " (level reload and F5/F9 savestates are off)" << endl;
+  return true;
+}
+
+void stop_recording ()
+{
+  if (!record_file)
+    return;
+  fprintf(record_file, "end %d\n", session_tick);
+  fclose(record_file);
+  record_file = NULL;
+}
+
+/* A recorded session read back: frametime and the self-test replay it */
+enum { KEY_INPUT, MOUSE_INPUT, SCROLL_INPUT };
+
+struct InputEvent {
+  int tick, type;
+  int key, down;      // key: down 1/0; mouse: button held; scroll: steps
+  double x, y;        // mouse: cursor
+  int click;          // mouse: pressed since the last tick
+};
+
+struct Session {
+  string path;
+  string level;   // level file, empty for the built-in board
+  string waves;   // wave script, empty for the endless game
+  string state;   // savestate to start from, empty for a fresh game
+  unsigned seed;
+  int cannons;
+  int stress;     // stress mode's block count, 0 when off
+  int jobs;       // job threads, 0 to leave them as they are
+  int frames;
+  vector<InputEvent> events;
+};
+
+bool load_session (const char* path, Session& s)
+{
+  ifstream in(path);
+  if (!in.is_open()) {
+    fprintf(stderr, "Error: cannot read session %s\n", path);
+    return false;
+  }
+  s.path = path;
+  s.level.clear();
+  s.waves.clear();
+  s.state.clear();
+  s.seed = 1;
+  s.cannons = 1;
+  s.stress = 0;
+  s.jobs = 0;
+  s.frames = 0;
+  s.events.clear();
+  string line;
+  while (getline(in, line)) {
+    InputEvent e = { 0, KEY_INPUT, 0, 0, 0, 0, 0 };
+    char file[256];
+    if (line.find("# block-shooter session v1") == 0) {
+      fprintf(stderr, "Error: %s applies keys a tick late (v1); re-record it\n", path);
+      return false;
+    }
+    if (line.empty() || line[0] == '#') continue;
+    if (sscanf(line.c_str(), "load %255s", file) == 1) {
+      s.state = file;
+      continue;
+    }
+    if (sscanf(line.c_str(), "level %255s", file) == 1) {
+      s.level = file;
+      continue;
+    }
+    if (sscanf(line.c_str(), "waves %255s", file) == 1) {
+      s.waves = file;
+      continue;
+    }
+    if (sscanf(line.c_str(), "seed %u", &s.seed) == 1) continue;
+    if (sscanf(line.c_str(), "cannons %d", &s.cannons) == 1) {
+      s.cannons = min(max(s.cannons, 1), max_cannons);
+      continue;
+    }
+    if (sscanf(line.c_str(), "stress %d", &s.stress) == 1) continue;
+    if (sscanf(line.c_str(), "jobs %d", &s.jobs) == 1) continue;
+    if (sscanf(line.c_str(), "end %d", &s.frames) == 1) continue;
+    if (sscanf(line.c_str(), "mouse %d %lf %lf %d %d", &e.tick, &e.x, &e.y, &e.down, &e.click) == 5)
+      e.type = MOUSE_INPUT;
+    else if (sscanf(line.c_str(), "scroll %d %d", &e.tick, &e.down) == 2)
+      e.type = SCROLL_INPUT;
+    else if (sscanf(line.c_str(), "%d %d %d", &e.tick, &e.key, &e.down) != 3 || e.key < 0 || e.key >= 10000)
+      continue;
+    s.events.push_back(e);
+    s.frames = max(s.frames, e.tick + 1);
+  }
+  return true;
+}
+
+/* Start a game as the session's recording did: its options, then a fresh
+   game or its savestate. False if a file it names does not load. */
+bool begin_replay (const Session& s)
+{
+  if (s.level.empty())
+    level = builtin_level();
+  else if (!load_level(s.level.c_str()))
+    return false;
+  createMirrorGeometry();
+  wave_script.clear();
+  if (!s.waves.empty() && !load_waves(s.waves.c_str()))
+    return false;
+  stress_mode = s.stress > 0;
+  num_blocks = stress_mode ? s.stress : 20;
+  if (s.jobs > 0)
+    jobs.start(s.jobs);
+  game_seed = s.seed;
+  num_cannons = s.cannons;
+  clear_input();
+  reset_game();
+  return s.state.empty() || load_state_file(s.state.c_str());
+}
+
+/* Before tick 'tick': hand the input recorded for it to latch_input, as
+   the callbacks did while recording. 'next' is the first event not yet
+   applied. */
+void replay_input (const Session& s, size_t &next, int tick)
+{
+  for(; next < s.events.size() && s.events[next].tick <= tick; next++) {
+    const InputEvent &e = s.events[next];
+    if (e.type == KEY_INPUT)
+      key_down[e.key] = e.down;
+    else if (e.type == MOUSE_INPUT) {
+      cursor_x = e.x, cursor_y = e.y;
+      button_down = e.down;
+      if (e.click)
+        click_pending = true;
+    }
+    else
+      scroll_steps += e.down;
+  }
+}
+
+/* One simulation tick. S receives the state to render for this tick,
+   taken where draw() used to run. Returns true on game over. */
+bool sim_step(RenderSnapshot &S) {
+  latch_input();
+  update_batteries();
+  L.clear();
+  reload_level();
+  savestate_keys();
+  if(tick_click) {
+    checkblock();
+    checkcanon();
+  }
+  apply_scroll();
+  translate_();
+  rotate_canon();
+  control_cannons();
+  shoot_mouse();
+  shoot();
+  take_snapshot(S);
+  update_blocks();
+  run_spawner();
+  MouseControl_baskets();
+  MouseControl_canon();
+  if(score_blocks()) {
+    emit_event(EV_GAME_OVER, 0, 0, 0, 0);
+    events.flush();
+    return true;
+  }
+  recheck_beam();
+  events.flush();
+  frame_no++;
+  session_tick++;
+  return false;
+}
+
+/* A lost game starts the next one in place: window, GL objects, shaders
+   and the audio stream stay up and only gameplay state is reset */
+bool restart_games = true;
+double last_restart_us = 0;
+
+/* Finished games go to the score log main opens (scores.log, --scores) */
+ScoreStore score_store;
+
+/* Queue the game's record at game over; the store's thread writes it */
+void store_events (const GameEvent *e, int n, void *)
+{
+  for(int k = 0; k < n; k++) {
+    if(e[k].type != EV_GAME_OVER || !score_store.is_open())
+      continue;
+    ScoreRecord r;
+    memset(&r, 0, sizeof r);
+    r.when = time(NULL);
+    r.score = Score;
+    r.frames = frame_no;
+    r.seconds = frame_no * tick_dt;
+    r.avg_fall = frame_no ? (total_fall - game_fall_start) / frame_no : block_trans;
+    r.frame_p50_ms = frame_times.percentile(0.5);
+    r.frame_p95_ms = frame_times.percentile(0.95);
+    r.hits = event_counts[EV_HIT], r.catches = event_counts[EV_CATCH], r.misses = event_counts[EV_MISS];
+    r.seed = game_seed;
+    int place = score_store.submit(r);
+    if(place >= 0)
+      cout << "Leaderboard place " << place + 1 << endl;
+  }
+}
+
+const bool store_consumer = (events.subscribe(store_events), true);
+
+/* The best n games in the score log */
+void print_top (int n)
+{
+  vector<ScoreEntry> top = score_store.top(n);
+  for(int k = 0; k < (int)top.size(); k++) {
+    char date[32];
+    time_t when = top[k].when;
+    strftime(date, sizeof date, "%Y-%m-%d %H:%M", localtime(&when));
+    printf("%3d. %8g  %s  %4.0f s\n", k + 1, top[k].score, date, top[k].seconds);
+  }
+  if(top.empty())
+    printf("No games recorded yet\n");
+}
+
+/* Restart once the game-over event is reported. Returns true if the run
+   should end instead: --once, or a recording (a session holds exactly one
+   game). */
+bool finish_game() {
+  if(!restart_games || record_file)
+    return true;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  game_seed++;
+  reset_game();
+  last_restart_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+  cout << "New game (restart took " << last_restart_us << " us)" << endl;
+  return false;
+}
+
+/* Simulation thread: ticks at a fixed rate and publishes a snapshot per
+   tick; the main thread only ever draws the newest one */
+TripleBuffer<RenderSnapshot> snapshots;
+atomic<bool> sim_running(false), game_over(false);
+bool threaded_sim = true;
+
+/* sim_step, timed for the overlay */
+bool timed_sim_step(RenderSnapshot &S) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  bool over = sim_step(S);
+  sim_tick_ms = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+  return over;
+}
+
+void sim_loop() {
+  chrono::steady_clock::time_point next = chrono::steady_clock::now();
+  const chrono::steady_clock::duration tick =
+    chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(tick_dt));
+  while(sim_running) {
+    bool over = timed_sim_step(snapshots.write_buffer());
+    snapshots.publish();
+    if(over && finish_game()) {
+      game_over = true;
+      break;
+    }
+    next += tick;
+    this_thread::sleep_until(next);
+  }
+}
+
+#ifndef SAMPLE2D_NO_MAIN
+/* Music: libao and mpg123 set up on their own thread while the window and
+   GL come up (opening the output device can take as long as the window).
+   The loop plays once 'ready' is set, so the first frames never wait. */
+struct Audio {
   mpg123_handle *mh;
+  ao_device *dev;
   unsigned char *buffer;
   size_t buffer_size;
-  size_t done;
-  int err;
-
-  int driver;
-  ao_device *dev;
+  long bytes_per_s;      // of the decoded stream
+  thread setup;
+  atomic<bool> ready;
+  bool joined;
+} audio;
 
-  ao_sample_format format;
-  int channels, encoding;
-  long rate;
-  /* initializations */
+void init_audio (const char *path)
+{
+  int err;
+  double t = startup_clock();
   ao_initialize();
-  driver = ao_default_driver_id();
+  int driver = ao_default_driver_id();
   mpg123_init();
-  mh = mpg123_new(NULL, &err);
-  buffer_size = 4096;
-  buffer = (unsigned char*) malloc(buffer_size * sizeof(unsigned char));
+  audio.mh = mpg123_new(NULL, &err);
+  audio.buffer_size = 4096;
+  audio.buffer = (unsigned char*) malloc(audio.buffer_size * sizeof(unsigned char));
+  startup_phase("audio libraries", t, true);
 
   /* open the file and get the decoding format */
-  mpg123_open(mh, argv[1]);
-  mpg123_getformat(mh, &rate, &channels, &encoding);
+  t = startup_clock();
+  long rate;
+  int channels, encoding;
+  mpg123_open(audio.mh, path);
+  mpg123_getformat(audio.mh, &rate, &channels, &encoding);
+  startup_phase("audio decoder", t, true);
 
   /* set the output format and open the output device */
+  t = startup_clock();
+  ao_sample_format format;
   format.bits = mpg123_encsize(encoding) * BITS;
   format.rate = rate;
   format.channels = channels;
   format.byte_format = AO_FMT_NATIVE;
   format.matrix = 0;
-  dev = ao_open_live(driver, &format, NULL);
+  audio.dev = ao_open_live(driver, &format, NULL);
+  audio.bytes_per_s = (long)rate * channels * mpg123_encsize(encoding);
+  startup_phase("audio device", t, true);
+  audio.ready = true;
+}
+
+/* True once the setup thread is done and joined; with 'wait', waits for it */
+bool audio_started (bool wait)
+{
+  if (!audio.joined && audio.setup.joinable() && (wait || audio.ready)) {
+    audio.setup.join();
+    audio.joined = true;
+    perf.audio_bytes_per_s = audio.dev ? audio.bytes_per_s : 0;
+  }
+  return audio.joined;
+}
+
+int main (int argc, char** argv)
+{ 
+  size_t done;
+  const char *load_path = NULL, *record_path = NULL;
+  const char *scores_path = "scores.log";
+  int top_games = 0;
+  startup_phase("static initialization", 0);
+  double t = startup_clock();
+
+  for(int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "--record") && i + 1 < argc)
+      record_path = argv[++i];
+    else if (!strcmp(argv[i], "--waves") && i + 1 < argc) {
+      waves_path = argv[++i];
+      wave_script.clear();  // the last --waves counts, as recorded
+      if (!load_waves(waves_path))
+        return 1;
+    }
+    else if (!strcmp(argv[i], "--single-thread"))
+      threaded_sim = false;
+    else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+      job_threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--perf"))
+      perf_overlay = true;
+    else if (!strcmp(argv[i], "--once"))
+      restart_games = false;
+    else if (!strcmp(argv[i], "--load") && i + 1 < argc)
+      load_path = argv[++i];
+    else if (!strcmp(argv[i], "--level") && i + 1 < argc) {
+      level_path = argv[++i];
+      if (!load_level(level_path))
+        return 1;
+      level_watch.start(level_path);
+    }
+    else if (!strcmp(argv[i], "--scores") && i + 1 < argc)
+      scores_path = argv[++i];
+    else if (!strcmp(argv[i], "--no-scores"))
+      scores_path = NULL;
+    else if (!strcmp(argv[i], "--top"))
+      top_games = (i + 1 < argc && isdigit(argv[i+1][0])) ? atoi(argv[++i]) : 10;
+    else if (!strcmp(argv[i], "--cannons") && i + 1 < argc)
+      num_cannons = min(max(atoi(argv[++i]), 1), max_cannons);
+    else if (!strcmp(argv[i], "--stress")) {
+      stress_mode = true;
+      num_blocks = (i + 1 < argc && isdigit(argv[i+1][0])) ? atoi(argv[++i]) : 10000;
+    }
+  }
+
+  if(scores_path)
+    score_store.open(scores_path);
+  if(top_games > 0) {
+    print_top(top_games);
+    return 0;
+  }
+  if(record_path && !start_recording(record_path, load_path))
+    return 1;
+  startup_phase("options, level and scores", t);
+
+  /* Audio and the shader files load while the window is created */
+  audio.setup = thread(init_audio, argv[1]);
+  thread assets(preload_shaders);
 
-  /* decode and play */
+  t = startup_clock();
+  if(job_threads < 1)
+    job_threads = max(1u, thread::hardware_concurrency());
+  jobs.start(job_threads);
+  startup_phase("job threads", t);
 
   int width = 600;
   int height = 600;
@@ -1403,37 +3194,69 @@ int main (int argc, char** argv)
   GLFWwindow* window = initGLFW(width, height);
   Window = window;
 
+  t = startup_clock();
+  assets.join();
+  startup_phase("waiting for shader sources", t);
   initGL (window, width, height);
+  if(load_path && !load_state_file(load_path)) {
+    audio_started(true);
+    return 1;
+  }
 
   double last_update_time = glfwGetTime(), current_time;
+  double last_frame_time = last_update_time;
+  bool first_frame = true;
+  RenderSnapshot frame;
+  thread sim;
+
+  update_cursor();
+  if(threaded_sim) {
+    take_snapshot(snapshots.write_buffer());
+    snapshots.publish();
+    sim_running = true;
+    sim = thread(sim_loop);
+  }
 
   /* Draw in loop */
-  while (!glfwWindowShouldClose(window)) {
-      if(Pfx <= -32.5) {
-        Pfx+=0.03;
+  while (!glfwWindowShouldClose(window) && !game_over) {
+      double phase_start = glfwGetTime();
+      if (audio_started(false) && audio.dev) {
+        if (mpg123_read(audio.mh, audio.buffer, audio.buffer_size, &done) == MPG123_OK) {
+          ao_play(audio.dev,(char *) audio.buffer, done);
+          perf.audio_bytes += done;
+        }
+        else
+          mpg123_seek(audio.mh, 0, SEEK_SET);
       }
+      phase_start = perf_phase(LOOP_AUDIO, phase_start);
 
-      if (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK)
-      ao_play(dev,(char *) buffer, done);
-      else
-        mpg123_seek(mh, 0, SEEK_SET);
-
-      createBattery();
+      if(threaded_sim) {
+        snapshots.acquire();
+      }
+      else if(timed_sim_step(frame) && finish_game()) {
+        game_over = true;
+        break;
+      }
+      phase_start = perf_phase(LOOP_SIM, phase_start);
       // OpenGL Draw commands
-      L.clear();
-      lazer.clear();
-      translate_();
-      rotate_canon();
-      shoot(); 
-      draw();
-      MouseControl_baskets();
-      shoot_mouse();
-      MouseControl_canon();
+      draw(threaded_sim ? snapshots.read_buffer() : frame);
+      phase_start = perf_phase(LOOP_DRAW, phase_start);
       // Swap Frame Buffer in double buffering
       glfwSwapBuffers(window);
+      current_time = perf_phase(LOOP_SWAP, phase_start);
+      frame_times.add((current_time - last_frame_time) * 1000);
+      perf_frame((current_time - last_frame_time) * 1000);
+      perf.gl = gl_trace_frame();
+      if(first_frame) {
+        print_startup(startup_clock());
+        first_frame = false;
+      }
+      last_frame_time = current_time;
 
       // Poll for Keyboard and mouse events
       glfwPollEvents();
+      update_cursor();
+      perf_phase(LOOP_INPUT, current_time);
 
       // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
       current_time = glfwGetTime(); // Time in seconds
@@ -1441,40 +3264,27 @@ int main (int argc, char** argv)
           // do something every 0.5 seconds ..
           last_update_time = current_time;
       }
+  }
 
-      for(int i = 1; i <= 20; i++) { 
-        if(current[i].y1 <= -37) {
-            if(current[i].color == 2) {
-                quit(window);
-                cout << "Game Over!" << endl;
-                cout << "Your final Score is: " << Score << endl;
-                return 0;
-            }
-            else if(current[i].color == 0) {
-              if(current[i].x1 <= b1 - 2.5 && current[i].x1 >= b1 - 12.5)
-                Score += 100;
-            }
-            else if(current[i].color == 1) {
-              if(current[i].x1 >= b2 + 2.5 && current[i].x1 <= b2 + 12.5)
-                Score += 100; 
-            }
-            createPieces(i);
-        }
-        cout << "Current Score is: " << Score << endl;
-      }
-
-      if(Shoot) {
-        for(int i = 0; i < L.size(); i++) {
-          checkhit(i);
-        }
-      }
+  if(threaded_sim) {
+    sim_running = false;
+    sim.join();
+  }
+  audio_started(true);
+  if(game_over) {
+      stop_recording();
+      score_store.close();
+      quit(window);
+      return 0;
   }
 
     /* clean up */
-  free(buffer);
-  ao_close(dev);
-  mpg123_close(mh);
-  mpg123_delete(mh);
+  stop_recording();
+  score_store.close();
+  free(audio.buffer);
+  ao_close(audio.dev);
+  mpg123_close(audio.mh);
+  mpg123_delete(audio.mh);
   mpg123_exit();
   ao_shutdown();
 
@@ -1483,4 +3293,5 @@ int main (int argc, char** argv)
 }
 
 
-//glfwGetCursorPos(window, &x, &y);
\ No newline at end of file
+//glfwGetCursorPos(window, &x, &y);
+#endif
@@ -0,0 +1,17 @@
+#version 330 core
+
+in vec2 atlasUV;
+in vec3 fragColor;
+
+// Font atlas: red channel set where a glyph is lit
+uniform sampler2D atlas;
+
+out vec3 color;
+
+void main()
+{
+    // Unlit texels leave the scene behind the text as it was
+    if (texture(atlas, atlasUV).r < 0.5)
+        discard;
+    color = fragColor;
+}
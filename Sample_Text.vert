@@ -0,0 +1,18 @@
+#version 330 core
+
+// HUD glyph quads: position in view units, atlas coordinate, colour
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec2 vertexUV;
+layout (location = 2) in vec3 vertexColor;
+
+uniform mat4 MVP;
+
+out vec2 atlasUV;
+out vec3 fragColor;
+
+void main ()
+{
+    atlasUV = vertexUV;
+    fragColor = vertexColor;
+    gl_Position = MVP * vec4(vertexPosition, 0, 1);
+}
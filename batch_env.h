@@ -0,0 +1,227 @@
+/* Batched headless game: N independent instances stepped in lockstep.
+ * Include after Sample_GL3_2D.cpp (with SAMPLE2D_NO_MAIN); needs no GL.
+ *
+ * Each instance follows sim_step()'s rules (battery, cannon, baskets, beam
+ * with mirror reflections, falling blocks, water/basket scoring) with its
+ * own state, clock and RNG; the battery is energy.h's, on the instance's
+ * clock, as the game's cannon 0 has it. All state is stored SoA: one array
+ * per field, blocks instance-major with K per instance, so the per-block
+ * passes are plain loops over contiguous floats. They are not written
+ * with intrinsics: GCC vectorizes them at -O3, and make bench_env prints
+ * the loops it vectorized (-fopt-info-vec) and fails if they are not all
+ * there. Instances are
+ * split over the job system. Instead of the wave spawner, a block that
+ * leaves play respawns at the top of its instance's column, keeping K
+ * blocks in every instance. The beam stops at mirrors for hit tests too.
+ * Board, limits and scores come from the game's current level.
+ */
+#ifndef BATCH_ENV_H
+#define BATCH_ENV_H
+
+/* Action bits, one mask per instance per step */
+enum EnvAction {
+  ACT_ROTATE_UP = 1, ACT_ROTATE_DOWN = 2,   // A / D
+  ACT_CANON_UP = 4, ACT_CANON_DOWN = 8,     // S / F
+  ACT_FIRE = 16,                            // SPACE
+  ACT_RED_LEFT = 32, ACT_RED_RIGHT = 64,    // Ctrl + Left / Right
+  ACT_GREEN_LEFT = 128, ACT_GREEN_RIGHT = 256 // Alt + Left / Right
+};
+
+class BatchEnv {
+public:
+  int N, K;
+
+  /* Per instance */
+  vector<float> score, reward, b1, b2, c, rot, speed;
+  vector<float> scored_b1, scored_b2;  // baskets at the previous water pass
+  vector<Battery> battery;
+  vector<double> sim_seconds;   // the instance's sim_time
+  vector<unsigned char> done;   // a black block reached the water; frozen until reset
+  vector<unsigned> rng;
+
+  /* Per block: block k of instance e is at e*K + k, bottom-left corner */
+  vector<float> bx, by;
+  vector<unsigned char> bcolor, flag;
+
+  BatchEnv (int instances, int blocks, unsigned seed) : N(instances), K(blocks), seed(seed)
+  {
+    score.resize(N); reward.resize(N); b1.resize(N); b2.resize(N);
+    scored_b1.resize(N); scored_b2.resize(N);
+    c.resize(N); rot.resize(N); speed.resize(N);
+    battery.resize(N); sim_seconds.resize(N);
+    done.resize(N); rng.resize(N);
+    bx.resize(N*K); by.resize(N*K); bcolor.resize(N*K); flag.resize(N*K);
+    reset();
+  }
+
+  void reset ()
+  {
+    for(int e = 0; e < N; e++)
+      reset(e);
+  }
+
+  /* Start instance e over, as reset_game() does for the game */
+  void reset (int e)
+  {
+    score[e] = reward[e] = 0;
+    b1[e] = scored_b1[e] = level->basket_start[0];
+    b2[e] = scored_b2[e] = level->basket_start[1];
+    c[e] = rot[e] = 0;
+    sim_seconds[e] = 0;
+    battery_reset(battery[e], 0, 0);
+    speed[e] = 0.3;
+    done[e] = 0;
+    rng[e] = (seed + e) * 2654435761u | 1;
+    for(int k = 0; k < K; k++)
+      place(e, k, spawn_line + k * (3 + level->gapy));
+  }
+
+  /* One tick of every running instance. actions[e] is a mask of EnvAction. */
+  void step (const unsigned short *actions)
+  {
+    jobs.parallel_for(0, N, 64, [this, actions](int begin, int end) {
+      for(int e = begin; e < end; e++)
+        if (!done[e])
+          step_one(e, actions[e]);
+    });
+  }
+
+private:
+  unsigned seed;
+
+  unsigned next (int e)
+  {
+    unsigned x = rng[e];
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return rng[e] = x;
+  }
+
+  /* Same ranges as the classic wave: the level's spawn range, any colour */
+  void place (int e, int k, float y)
+  {
+    int i = e*K + k;
+    bx[i] = level->spawn_xmin + next(e) % max(1, (int)(level->spawn_xmax - level->spawn_xmin + 1));
+    bcolor[i] = next(e) % 3;
+    by[i] = y;
+  }
+
+  /* Next block of the column goes one block plus gapy above the highest */
+  void respawn (int e, int k)
+  {
+    const float *Y = &by[e*K];
+    const float gapy = level->gapy;
+    float top = spawn_line - (3 + gapy);
+    for(int j = 0; j < K; j++)
+      top = max(top, Y[j]);
+    place(e, k, top + 3 + gapy);
+  }
+
+  /* Beam from the cannon as LazerWithMirror lays it out; returns segment count */
+  int trace (int e, Lazer *segs)
+  {
+    int used[max_bounces], n = 0;
+    segs[n++] = (Lazer){-40, c[e], rot[e], 500, 540*tan(rot[e]) + c[e]};
+    while (n <= max_bounces) {
+      Lazer cut, reflected;
+      int i = nextBounce(segs[n-1], used, n - 1, cut, reflected);
+      if (i < 0)
+        break;
+      used[n-1] = i;
+      segs[n-1] = cut;
+      segs[n++] = reflected;
+    }
+    return n;
+  }
+
+  /* Score and respawn every block any segment touches (slab test as in
+     checkhit), each box stretched up by 'sweep' as in recheck_beam() */
+  void hit_blocks (int e, const Lazer *segs, int nsegs, float sweep)
+  {
+    // Local count and restrict: byte stores could otherwise alias K and the floats
+    const int n = K;
+    const float *__restrict X = &bx[e*K], *__restrict Y = &by[e*K];
+    unsigned char *__restrict F = &flag[e*K];
+    for(int k = 0; k < n; k++)
+      F[k] = 0;
+    for(int s = 0; s < nsegs; s++) {
+      const SlabRay r = slab_ray(segs[s].x1, segs[s].y1, segs[s].x2, segs[s].y2);
+      for(int k = 0; k < n; k++)
+        F[k] |= slab_hit(r, X[k], Y[k], X[k] + 1, Y[k] + 3 + sweep);
+    }
+    for(int k = 0; k < K; k++)
+      if (F[k]) {
+        reward[e] += bcolor[e*K + k] == 2 ? level->score_black_shot : level->score_other_shot;
+        respawn(e, k);
+      }
+  }
+
+  /* Water/basket pass of score_blocks(), baskets interpolated to the
+     moment each block crossed as in classify_block() */
+  void score_water (int e)
+  {
+    const float dy = speed[e], water = level->water_line;
+    const int n = K;
+    const float *__restrict Y = &by[e*K];
+    unsigned char *__restrict F = &flag[e*K];
+    for(int k = 0; k < n; k++)
+      F[k] = Y[k] <= water;
+    for(int k = 0; k < K; k++) {
+      if (!F[k]) continue;
+      int i = e*K + k;
+      if (bcolor[i] == 2) {
+        done[e] = 1;
+        return;
+      }
+      float t = dy > 0 ? min(1.0f, max(0.0f, (by[i] + dy - water) / dy)) : 1;
+      float B1 = scored_b1[e] + (b1[e] - scored_b1[e]) * t;
+      float B2 = scored_b2[e] + (b2[e] - scored_b2[e]) * t;
+      if (bcolor[i] == 0 && bx[i] <= B1 - 2.5 && bx[i] >= B1 - 12.5)
+        reward[e] += level->score_caught;
+      else if (bcolor[i] == 1 && bx[i] >= B2 + 2.5 && bx[i] <= B2 + 12.5)
+        reward[e] += level->score_caught;
+      respawn(e, k);
+    }
+    scored_b1[e] = b1[e], scored_b2[e] = b2[e];
+  }
+
+  void step_one (int e, unsigned a)
+  {
+    reward[e] = 0;
+
+    // translate_() and rotate_canon()
+    const Level &l = *level;
+    if (a & ACT_RED_LEFT) { if (b1[e] >= l.basket_min[0]) b1[e] -= l.basket_step; }
+    else if (a & ACT_RED_RIGHT) { if (b1[e] <= l.basket_max[0]) b1[e] += l.basket_step; }
+    else if (a & ACT_GREEN_LEFT) { if (b2[e] >= l.basket_min[1]) b2[e] -= l.basket_step; }
+    else if (a & ACT_GREEN_RIGHT) { if (b2[e] <= l.basket_max[1]) b2[e] += l.basket_step; }
+    if (a & ACT_CANON_UP) { if (c[e] <= l.cannon_max) c[e] += l.cannon_step; }
+    else if (a & ACT_CANON_DOWN) { if (c[e] >= l.cannon_min) c[e] -= l.cannon_step; }
+    if (a & ACT_ROTATE_UP) { if (rot[e] < l.turn_limit) rot[e] += l.turn_step; }
+    else if (a & ACT_ROTATE_DOWN) { if (rot[e] > -l.turn_limit) rot[e] -= l.turn_step; }
+
+    // shoot(): the trigger turns the drain on or off, charge left fires
+    Lazer segs[max_bounces + 1];
+    int nsegs = 0;
+    bool firing = a & ACT_FIRE;
+    if (firing != battery_draining(battery[e]))
+      battery_set_drain(battery[e], sim_seconds[e], firing);
+    if (firing && battery_charge(battery[e], sim_seconds[e]) > 0) {
+      nsegs = trace(e, segs);
+      hit_blocks(e, segs, nsegs, 0);
+    }
+
+    // update_blocks()
+    float *Y = &by[e*K];
+    const float dy = speed[e];
+    for(int k = 0; k < K; k++)
+      Y[k] -= dy;
+
+    score_water(e);
+    if (!done[e] && nsegs)
+      hit_blocks(e, segs, nsegs, dy); // recheck_beam()
+    score[e] += reward[e];
+    sim_seconds[e] += tick_dt;  // run_spawner() moves the game's clock after the shot
+  }
+};
+
+#endif
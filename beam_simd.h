@@ -0,0 +1,148 @@
+/* Segment-vs-box slab test over blocks stored SoA.
+ * For the segment P + t*(Q - P), t in [0, 1], and box i spanning
+ * [x1[i], x2[i]] x [y1[i], y2[i]], sets bit i of 'mask' (32 boxes per word)
+ * when the segment touches the box. Branchless; a vertical or horizontal
+ * segment takes a huge finite inverse instead of dividing by zero, so
+ * every angle works.
+ *
+ * slab_test() picks the widest kernel the CPU runs: AVX-512 (16 boxes per
+ * instruction), AVX2 (8) or SSE (4); the scalar kernel covers other CPUs
+ * and is the reference.
+ */
+#ifndef BEAM_SIMD_H
+#define BEAM_SIMD_H
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SLAB_X86 1
+#endif
+
+struct SlabRay {
+  float px, py, inv_dx, inv_dy;
+};
+
+inline SlabRay slab_ray (float px, float py, float qx, float qy)
+{
+  float dx = qx - px, dy = qy - py;
+  SlabRay r = { px, py, dx != 0 ? 1 / dx : 1e30f, dy != 0 ? 1 / dy : 1e30f };
+  return r;
+}
+
+inline bool slab_hit (const SlabRay &r, float x1, float y1, float x2, float y2)
+{
+  float tx1 = (x1 - r.px) * r.inv_dx, tx2 = (x2 - r.px) * r.inv_dx;
+  float ty1 = (y1 - r.py) * r.inv_dy, ty2 = (y2 - r.py) * r.inv_dy;
+  float tmin = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), 0.0f);
+  float tmax = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), 1.0f);
+  return tmin <= tmax;
+}
+
+/* Boxes [begin, end); begin must be a multiple of 32 */
+inline void slab_test_scalar (const float *x1, const float *y1, const float *x2, const float *y2,
+                              int begin, int end, const SlabRay &r, unsigned *mask)
+{
+  memset(mask + begin/32, 0, ((end - begin + 31) / 32) * sizeof(unsigned));
+  for(int i = begin; i < end; i++)
+    mask[i >> 5] |= (unsigned)slab_hit(r, x1[i], y1[i], x2[i], y2[i]) << (i & 31);
+}
+
+#ifdef SLAB_X86
+
+__attribute__((target("sse2")))
+inline void slab_test_sse (const float *x1, const float *y1, const float *x2, const float *y2,
+                           int begin, int end, const SlabRay &r, unsigned *mask)
+{
+  memset(mask + begin/32, 0, ((end - begin + 31) / 32) * sizeof(unsigned));
+  const __m128 px = _mm_set1_ps(r.px), py = _mm_set1_ps(r.py);
+  const __m128 ix = _mm_set1_ps(r.inv_dx), iy = _mm_set1_ps(r.inv_dy);
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+  int i = begin;
+  for(; i + 4 <= end; i += 4) {
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(x1 + i), px), ix);
+    __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(x2 + i), px), ix);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(y1 + i), py), iy);
+    __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(y2 + i), py), iy);
+    __m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), zero);
+    __m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), one);
+    mask[i >> 5] |= (unsigned)_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << (i & 31);
+  }
+  for(; i < end; i++)
+    mask[i >> 5] |= (unsigned)slab_hit(r, x1[i], y1[i], x2[i], y2[i]) << (i & 31);
+}
+
+__attribute__((target("avx2")))
+inline void slab_test_avx2 (const float *x1, const float *y1, const float *x2, const float *y2,
+                            int begin, int end, const SlabRay &r, unsigned *mask)
+{
+  memset(mask + begin/32, 0, ((end - begin + 31) / 32) * sizeof(unsigned));
+  const __m256 px = _mm256_set1_ps(r.px), py = _mm256_set1_ps(r.py);
+  const __m256 ix = _mm256_set1_ps(r.inv_dx), iy = _mm256_set1_ps(r.inv_dy);
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+  int i = begin;
+  for(; i + 8 <= end; i += 8) {
+    __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x1 + i), px), ix);
+    __m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x2 + i), px), ix);
+    __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(y1 + i), py), iy);
+    __m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(y2 + i), py), iy);
+    __m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_min_ps(ty1, ty2)), zero);
+    __m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_max_ps(ty1, ty2)), one);
+    mask[i >> 5] |= (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)) << (i & 31);
+  }
+  for(; i < end; i++)
+    mask[i >> 5] |= (unsigned)slab_hit(r, x1[i], y1[i], x2[i], y2[i]) << (i & 31);
+}
+
+__attribute__((target("avx512f")))
+inline void slab_test_avx512 (const float *x1, const float *y1, const float *x2, const float *y2,
+                              int begin, int end, const SlabRay &r, unsigned *mask)
+{
+  memset(mask + begin/32, 0, ((end - begin + 31) / 32) * sizeof(unsigned));
+  const __m512 px = _mm512_set1_ps(r.px), py = _mm512_set1_ps(r.py);
+  const __m512 ix = _mm512_set1_ps(r.inv_dx), iy = _mm512_set1_ps(r.inv_dy);
+  const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1);
+  int i = begin;
+  for(; i + 16 <= end; i += 16) {
+    __m512 tx1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(x1 + i), px), ix);
+    __m512 tx2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(x2 + i), px), ix);
+    __m512 ty1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(y1 + i), py), iy);
+    __m512 ty2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(y2 + i), py), iy);
+    __m512 tmin = _mm512_max_ps(_mm512_max_ps(_mm512_min_ps(tx1, tx2), _mm512_min_ps(ty1, ty2)), zero);
+    __m512 tmax = _mm512_min_ps(_mm512_min_ps(_mm512_max_ps(tx1, tx2), _mm512_max_ps(ty1, ty2)), one);
+    mask[i >> 5] |= (unsigned)_mm512_cmp_ps_mask(tmin, tmax, _CMP_LE_OQ) << (i & 31);
+  }
+  for(; i < end; i++)
+    mask[i >> 5] |= (unsigned)slab_hit(r, x1[i], y1[i], x2[i], y2[i]) << (i & 31);
+}
+
+#endif
+
+typedef void (*SlabKernel) (const float*, const float*, const float*, const float*,
+                            int, int, const SlabRay&, unsigned*);
+
+/* Widest kernel this CPU supports, and its name */
+inline SlabKernel slab_best_kernel (const char **name = NULL)
+{
+  const char *n = "scalar";
+  SlabKernel k = slab_test_scalar;
+#ifdef SLAB_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) n = "avx512", k = slab_test_avx512;
+  else if (__builtin_cpu_supports("avx2")) n = "avx2", k = slab_test_avx2;
+  else if (__builtin_cpu_supports("sse2")) n = "sse", k = slab_test_sse;
+#endif
+  if (name)
+    *name = n;
+  return k;
+}
+
+inline void slab_test (const float *x1, const float *y1, const float *x2, const float *y2,
+                       int begin, int end, const SlabRay &r, unsigned *mask)
+{
+  static const SlabKernel kernel = slab_best_kernel();
+  kernel(x1, y1, x2, y2, begin, end, r, mask);
+}
+
+#endif
@@ -0,0 +1,82 @@
+/* Throughput of the batched environment.
+ * Steps N instances of BatchEnv in lockstep under a fixed random policy
+ * (fire, turn and move the baskets at random) and reports steps per
+ * second for each instance count, plus how the games went.
+ *
+ * Usage: ./bench_env [-n 1,64,1024,8192] [-k blocks] [-t ticks] [-j threads] [-s seed]
+ */
+#define SAMPLE2D_NO_MAIN
+#include "Sample_GL3_2D.cpp"
+#include "batch_env.h"
+
+#include <chrono>
+#include <cstring>
+
+using namespace std::chrono;
+
+vector<int> parseInts (const char* arg)
+{
+  vector<int> v;
+  for (const char* p = arg; *p; ) {
+    v.push_back(atoi(p));
+    while (*p && *p != ',') p++;
+    if (*p == ',') p++;
+  }
+  return v;
+}
+
+int main (int argc, char** argv)
+{
+  vector<int> counts = parseInts("1,64,1024,8192");
+  int blocks = num_blocks;
+  int ticks = 2000;
+  unsigned seed = 1;
+
+  for(int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) counts = parseInts(argv[++i]);
+    else if (!strcmp(argv[i], "-k") && i + 1 < argc) blocks = max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc) ticks = max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc) jobs.start(max(1, atoi(argv[++i])));
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc) seed = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [-n 1,64,1024,8192] [-k blocks] [-t ticks] [-j threads] [-s seed]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  createMirrorGeometry();
+  printf("job threads: %d, blocks/instance: %d, ticks: %d\n", jobs.workers(), blocks, ticks);
+  printf("%10s %12s %14s %12s %12s\n", "instances", "ms/tick", "steps/s", "mean score", "games over");
+
+  for(int t = 0; t < (int)counts.size(); t++) {
+    int N = max(1, counts[t]);
+    BatchEnv env(N, blocks, seed);
+    vector<unsigned short> actions(N);
+    unsigned policy = seed * 747796405u | 1;
+    double seconds = 0;
+    int finished = 0;
+
+    for(int tick = 0; tick < ticks; tick++) {
+      for(int e = 0; e < N; e++) {
+        policy ^= policy << 13; policy ^= policy >> 17; policy ^= policy << 5;
+        actions[e] = ACT_FIRE | (1 << (policy % 2)) | (ACT_RED_LEFT << (policy >> 8) % 4);
+      }
+      steady_clock::time_point start = steady_clock::now();
+      env.step(&actions[0]);
+      seconds += duration<double>(steady_clock::now() - start).count();
+      // Restart finished games, untimed, so every tick steps all N
+      for(int e = 0; e < N; e++)
+        if (env.done[e]) {
+          finished++;
+          env.reset(e);
+        }
+    }
+
+    double mean = 0;
+    for(int e = 0; e < N; e++)
+      mean += env.score[e];
+    printf("%10d %12.4f %14.0f %12.1f %12d\n", N, 1e3 * seconds / ticks,
+           (double)N * ticks / seconds, mean / N, finished);
+  }
+  return 0;
+}
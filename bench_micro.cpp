@@ -0,0 +1,305 @@
+/* Microbenchmarks for the game's hot functions.
+ * Runs checkhit (with and without the hit cache), the slab-test kernels, LazerWithMirror, the mirror BVH
+ * against a scan of every mirror, createPieces, pool spawn/despawn,
+ * savestate save/restore, the in-place restart (reset_game)
+ * and the per-frame block update and water/basket scan in isolation over block counts, mirror counts and beam angles.
+ * Each case is calibrated to a minimum sample time, sampled repeatedly, and
+ * reported as mean ns/op with a 95% confidence interval, operator-new
+ * allocations per op and throughput. -j runs the block stages on that many
+ * job-system threads (default 1, i.e. serial).
+ *
+ * Usage: ./bench_micro [-k samples] [-t min_sample_ms] [-j threads] [filter]
+ */
+#define SAMPLE2D_NO_MAIN
+#include "Sample_GL3_2D.cpp"
+#include "offscreen.h"
+
+#include <chrono>
+#include <cstring>
+#include <new>
+
+using namespace std::chrono;
+
+/* Count every heap allocation that goes through operator new */
+long long alloc_count = 0;
+
+void* operator new (size_t size)
+{
+  alloc_count++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[] (size_t size) { return operator new(size); }
+void operator delete (void* p) noexcept { free(p); }
+void operator delete[] (void* p) noexcept { free(p); }
+void operator delete (void* p, size_t) noexcept { free(p); }
+void operator delete[] (void* p, size_t) noexcept { free(p); }
+
+int samples = 15;
+double min_sample_ms = 5;
+const char* filter = NULL;
+volatile float sink;
+
+/* Two-sided 95% Student t quantiles for df = 1..30 */
+double t95 (int df)
+{
+  static const double t[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                              2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                              2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+  if (df < 1) return 0;
+  return df <= 30 ? t[df - 1] : 1.96;
+}
+
+/* Time 'op', re-running 'setup' (untimed) before every sample */
+template <class Setup, class Op>
+void measure (const char* name, const char* params, Setup setup, Op op)
+{
+  if (filter && !strstr(name, filter))
+    return;
+
+  // Grow the batch until one sample takes at least min_sample_ms
+  long batch = 1;
+  for (;;) {
+    setup();
+    steady_clock::time_point start = steady_clock::now();
+    for(long i = 0; i < batch; i++) op();
+    double ms = duration<double, milli>(steady_clock::now() - start).count();
+    if (ms >= min_sample_ms || batch >= (1L << 26)) break;
+    batch *= 2;
+  }
+
+  vector<double> ns;
+  long long allocs = 0;
+  for(int k = 0; k < samples; k++) {
+    setup();
+    long long before = alloc_count;
+    steady_clock::time_point start = steady_clock::now();
+    for(long i = 0; i < batch; i++) op();
+    double total = duration<double, nano>(steady_clock::now() - start).count();
+    allocs += alloc_count - before;
+    ns.push_back(total / batch);
+  }
+
+  double mean = 0, var = 0;
+  for(int k = 0; k < samples; k++) mean += ns[k];
+  mean /= samples;
+  for(int k = 0; k < samples; k++) var += (ns[k] - mean) * (ns[k] - mean);
+  var /= max(1, samples - 1);
+  double ci = t95(samples - 1) * sqrt(var / samples);
+
+  printf("%-16s %-32s %12.1f %10.1f %11.2f %13.3f\n", name, params, mean, ci,
+         (double)allocs / ((double)batch * samples), 1e3 / mean);
+}
+
+BlockPool saved_pool;
+
+/* Blocks spread over the playfield so they overlap the beam */
+void setupScene (int blocks)
+{
+  game_seed = 1;
+  reset_game();
+  for(int i = 0; i < blocks; i++)
+    spawn_block(0, rand() % 70 - 35);
+  saved_pool = pool;
+}
+
+void restoreScene ()
+{
+  pool = saved_pool;
+  Score = 0;
+  events.clear();
+  invalidate_beam_cache();
+}
+
+/* The first beam segment exactly as shoot() builds it */
+void primaryBeam (float angle)
+{
+  L.clear();
+  c = 0;
+  rot = angle;
+  L.push_back((Lazer){-40, c, rot, 500, 540*tan(rot) + c});
+  begin_beam_pass();
+}
+
+/* Mirrors not in play are pre-inserted into LazerWithMirror's skip set */
+set<int> mirrorSkip (int mirrors)
+{
+  set<int> s;
+  for(int i = mirrors; i < level->mirrors; i++) s.insert(i);
+  return s;
+}
+
+/* A maze of n short mirrors at random spots and angles in the view */
+vector<LevelMirror> randomMirrors (int n)
+{
+  vector<LevelMirror> v(n);
+  for(int i = 0; i < n; i++) {
+    float x = rand() % 8000 / 100.0f - 40, y = rand() % 8000 / 100.0f - 40;
+    float a = rand() % 314 / 100.0f, len = 0.5f + rand() % 100 / 100.0f;
+    LevelMirror M = { x, y, x + len*cosf(a), y + len*sinf(a), a };
+    v[i] = M;
+  }
+  return v;
+}
+
+/* What the BVH replaces: every mirror tested against the ray */
+int nearestByScan (const vector<LevelMirror> &v, float ox, float oy, float dx, float dy)
+{
+  int best = -1;
+  float best_t = 1;
+  for(int k = 0; k < (int)v.size(); k++) {
+    float ex = v[k].x2 - v[k].x1, ey = v[k].y2 - v[k].y1;
+    float denom = dx * ey - dy * ex;
+    if (denom == 0)
+      continue;
+    float wx = v[k].x1 - ox, wy = v[k].y1 - oy;
+    float s = (wx * ey - wy * ex) / denom, u = (wx * dy - wy * dx) / denom;
+    if (s > 0 && s < best_t && u >= 0 && u <= 1)
+      best = k, best_t = s;
+  }
+  return best;
+}
+
+int main (int argc, char** argv)
+{
+  for(int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-k") && i + 1 < argc) samples = max(2, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc) min_sample_ms = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc) jobs.start(max(1, atoi(argv[++i])));
+    else if (argv[i][0] != '-') filter = argv[i];
+    else {
+      fprintf(stderr, "Usage: %s [-k samples] [-t min_sample_ms] [-j threads] [filter]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (!initOffscreen(64, 64))
+    return 1;
+  initGL(NULL, 64, 64);
+
+  const int block_counts[] = { 20, 1000, 10000 };
+  const float angles[] = { -0.21f, 0.0f, 0.3f, 0.6f };
+  char params[64];
+
+  printf("job threads: %d\n", jobs.workers());
+  printf("\n%-16s %-32s %12s %10s %11s %13s\n", "benchmark", "params", "ns/op", "+/-95%", "allocs/op", "Mops/s");
+
+  for (int b : block_counts) {
+    setupScene(b);
+    snprintf(params, sizeof params, "blocks=%d", b);
+    measure("update_blocks", params, restoreScene, [] { update_blocks(); });
+    measure("score_blocks", params, restoreScene, [] { score_blocks(); });
+    measure("createPieces", params, restoreScene, [] {
+      static int i = 0;
+      createPieces(pool.live[i++ % pool.size()], 0, spawn_line);
+    });
+    static vector<char> blob;
+    save_state(blob);
+    measure("save_state", params, restoreScene, [] { save_state(blob); });
+    measure("load_state", params, restoreScene, [] { load_state(&blob[0], blob.size()); });
+    // Upper bound: includes copying the scene back in before every reset
+    measure("restore+reset", params, [] {}, [] { restoreScene(); reset_game(); });
+    measure("spawn+despawn", params, restoreScene, [] {
+      static int i = 0;
+      despawn_block(pool.live[i++ % pool.size()]);
+      spawn_block(0, spawn_line);
+    });
+  }
+
+  for (int b : block_counts) {
+    setupScene(b);
+    for (float a : angles) {
+      snprintf(params, sizeof params, "blocks=%d angle=%.2f", b, a);
+      measure("checkhit", params, [a] { restoreScene(); primaryBeam(a); }, [] { checkhit(0); });
+      // Every call a full query, as before the hit cache
+      beam_cache = false;
+      measure("checkhit/nocache", params, [a] { restoreScene(); primaryBeam(a); }, [] { checkhit(0); });
+      beam_cache = true;
+    }
+  }
+
+  // Slab kernels over the gathered boxes, against the left-edge test checkhit used before
+  struct { const char *name; SlabKernel kernel; bool ok; } kernels[] = {
+    { "slab/scalar", slab_test_scalar, true },
+#ifdef SLAB_X86
+    { "slab/sse", slab_test_sse, (bool)__builtin_cpu_supports("sse2") },
+    { "slab/avx2", slab_test_avx2, (bool)__builtin_cpu_supports("avx2") },
+    { "slab/avx512", slab_test_avx512, (bool)__builtin_cpu_supports("avx512f") },
+#endif
+  };
+  for (int b : block_counts) {
+    setupScene(b);
+    primaryBeam(0.3f);
+    gather_targets(0, 0, 0);
+    const Lazer S = L[0];
+    const SlabRay r = slab_ray(S.x1, S.y1, S.x2, S.y2);
+    snprintf(params, sizeof params, "blocks=%d", b);
+    measure("edge-test(old)", params, [] {}, [S] {
+      int hits = 0;
+      for(int n = 0; n < pool.size(); n++) {
+        const Piece &P = pool.cur[pool.live[n]];
+        float y = (P.x1 - S.x1) * tan(S.ang) + S.y1;
+        hits += y >= P.y1 && y <= P.y2 && P.x1 >= min(S.x1, S.x2) && P.x1 <= max(S.x1, S.x2);
+      }
+      sink = hits;
+    });
+    for (auto &k : kernels) {
+      if (!k.ok) continue;
+      SlabKernel kernel = k.kernel;
+      measure(k.name, params, [] {}, [r, kernel] {
+        kernel(targets.x1.data(), targets.y1.data(), targets.x2.data(), targets.y2.data(),
+               0, targets.slot.size(), r, targets.mask.data());
+        sink = targets.mask[0];
+      });
+    }
+  }
+
+  setupScene(20);
+  for(int mirrors = 0; mirrors <= 3; mirrors++) {
+    for (float a : angles) {
+      primaryBeam(a);
+      LazerWithMirror(mirrorSkip(mirrors));
+      snprintf(params, sizeof params, "mirrors=%d angle=%.2f segs=%d", mirrors, a, (int)L.size());
+      measure("LazerWithMirror", params, restoreScene, [a, mirrors] {
+        primaryBeam(a);
+        LazerWithMirror(mirrorSkip(mirrors));
+      });
+    }
+  }
+
+  // Nearest mirror along a beam: BVH against scanning them all
+  const int mirror_counts[] = { 3, 100, 1000, 10000 };
+  for (int n : mirror_counts) {
+    static vector<LevelMirror> maze;
+    static SegmentBVH bvh;
+    static vector<float> rays;
+    srand(n);
+    maze = randomMirrors(n);
+    bvh.build(&maze[0], n);
+    rays.resize(256);
+    for(int i = 0; i < 256; i++)
+      rays[i] = (rand() % 300 - 150) / 100.0f; // cannon height and angle as shoot() would
+    int agree = 0;
+    for(int i = 0; i < 256; i += 2) {
+      float t, dy = 540*tan(rays[i+1]);
+      agree += bvh.nearest(-40, rays[i]*20, 540, dy, 1, NULL, 0, t) == nearestByScan(maze, -40, rays[i]*20, 540, dy);
+    }
+    snprintf(params, sizeof params, "mirrors=%d agree=%d/128", n, agree);
+    measure("mirror-bvh", params, [] {}, [] {
+      static int i = 0;
+      int r = (i++ & 127) * 2;
+      float t, h = rays[r] * 20, dy = 540*tan(rays[r+1]);
+      sink = bvh.nearest(-40, h, 540, dy, 1, NULL, 0, t);
+    });
+    measure("mirror-scan", params, [] {}, [] {
+      static int i = 0;
+      int r = (i++ & 127) * 2;
+      float h = rays[r] * 20, dy = 540*tan(rays[r+1]);
+      sink = nearestByScan(maze, -40, h, 540, dy);
+    });
+  }
+
+  quitOffscreen();
+  return 0;
+}
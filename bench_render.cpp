@@ -0,0 +1,172 @@
+/* Offscreen render benchmark.
+ * Replays a fixed scene (same seed, same block layout every frame) through
+ * the game's own draw path on a headless EGL context with vsync off, and
+ * reports ms/frame, draw calls and vertices for each block count/resolution.
+ *
+ * --per-block draws each block with its own call instead of the streamed batch.
+ *
+ * Usage: ./bench_render [-n 20,1000,10000] [-r 600x600,1920x1080] [-f frames] [-s seed] [--beam] [--per-block]
+ */
+#define SAMPLE2D_NO_MAIN
+#include "Sample_GL3_2D.cpp"
+#include "offscreen.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+using namespace std::chrono;
+
+struct RenderResult {
+  double mean_ms, p50_ms, p95_ms;
+  double draw_calls, vertices;
+  double drawn, culled;
+};
+
+BlockPool saved_pool;
+RenderSnapshot snap;
+
+/* Spawn a deterministic scene of 'blocks' pieces, about half of them in
+   view and the rest queued above it, and remember it */
+void setupScene (int blocks, unsigned seed)
+{
+  game_seed = seed;
+  reset_game();
+  for(int i = 0; i < blocks; i++)
+    spawn_block(0, rand() % 160 - 40);
+  saved_pool = pool;
+}
+
+/* Put the scene back so every frame renders the same thing */
+void restoreScene ()
+{
+  pool = saved_pool;
+  Score = 0;
+  events.clear();
+  battery_reset(cannons[0].battery, 1, sim_time); // full battery so the beam never cuts out
+  invalidate_beam_cache();
+}
+
+/* One frame of main()'s render half, finished on the GPU */
+void renderFrame (bool beam)
+{
+  restoreScene();
+  L.clear();
+  if (beam)
+    shoot();
+  take_snapshot(snap);
+  draw(snap);
+  glFinish();
+}
+
+RenderResult runScene (int frames, bool beam)
+{
+  RenderResult r;
+  vector<double> ms;
+  long calls = 0, verts = 0, drawn = 0, culled = 0;
+
+  pressed[GLFW_KEY_SPACE] = beam;
+  rot = 0.3;
+  c = -10;
+
+  for(int i = 0; i < 10; i++)
+    renderFrame(beam); // warm up
+
+  for(int i = 0; i < frames; i++) {
+    steady_clock::time_point start = steady_clock::now();
+    renderFrame(beam);
+    ms.push_back(duration<double, milli>(steady_clock::now() - start).count());
+    calls += draw_calls;
+    verts += draw_vertices;
+    drawn += blocks_drawn;
+    culled += blocks_culled;
+  }
+
+  double sum = 0;
+  for(int i = 0; i < (int)ms.size(); i++)
+    sum += ms[i];
+  sort(ms.begin(), ms.end());
+  r.mean_ms = sum / frames;
+  r.p50_ms = ms[ms.size() / 2];
+  r.p95_ms = ms[min(ms.size() - 1, (size_t)(ms.size() * 0.95))];
+  r.draw_calls = (double)calls / frames;
+  r.vertices = (double)verts / frames;
+  r.drawn = (double)drawn / frames;
+  r.culled = (double)culled / frames;
+  return r;
+}
+
+vector<int> parseInts (const char* arg)
+{
+  vector<int> v;
+  for (const char* p = arg; *p; ) {
+    v.push_back(atoi(p));
+    while (*p && *p != ',') p++;
+    if (*p == ',') p++;
+  }
+  return v;
+}
+
+vector<pair<int, int> > parseResolutions (const char* arg)
+{
+  vector<pair<int, int> > v;
+  for (const char* p = arg; *p; ) {
+    int w = 0, h = 0;
+    if (sscanf(p, "%dx%d", &w, &h) == 2)
+      v.push_back(make_pair(w, h));
+    while (*p && *p != ',') p++;
+    if (*p == ',') p++;
+  }
+  return v;
+}
+
+int main (int argc, char** argv)
+{
+  vector<int> block_counts = parseInts("20,1000,10000");
+  vector<pair<int, int> > resolutions = parseResolutions("600x600,1920x1080");
+  int frames = 300;
+  unsigned seed = 1;
+  bool beam = false;
+
+  for(int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) block_counts = parseInts(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc) resolutions = parseResolutions(argv[++i]);
+    else if (!strcmp(argv[i], "-f") && i + 1 < argc) frames = max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc) seed = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--beam")) beam = true;
+    else if (!strcmp(argv[i], "--per-block")) batch_blocks = false;
+    else {
+      fprintf(stderr, "Usage: %s [-n 20,1000,10000] [-r 600x600,1920x1080] [-f frames] [-s seed] [--beam] [--per-block]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (!initOffscreen(resolutions[0].first, resolutions[0].second))
+    return 1;
+  initGL(NULL, resolutions[0].first, resolutions[0].second);
+
+  printf("path: %s\n", batch_blocks ? "batched" : "per-block");
+  printf("%8s %11s %5s %10s %10s %10s %12s %12s %8s %8s\n",
+         "blocks", "resolution", "beam", "mean ms", "p50 ms", "p95 ms", "draws/frame", "verts/frame", "drawn", "culled");
+  for(int r = 0; r < (int)resolutions.size(); r++) {
+    int w = resolutions[r].first, h = resolutions[r].second;
+    if (!resizeOffscreen(w, h)) {
+      fprintf(stderr, "Error: could not create %dx%d pbuffer\n", w, h);
+      return 1;
+    }
+    glViewport(0, 0, w, h);
+    for(int b = 0; b < (int)block_counts.size(); b++) {
+      int blocks = max(1, block_counts[b]);
+      setupScene(blocks, seed);
+      RenderResult res = runScene(frames, beam);
+      char resolution[32];
+      snprintf(resolution, sizeof resolution, "%dx%d", w, h);
+      printf("%8d %11s %5s %10.3f %10.3f %10.3f %12.1f %12.1f %8.0f %8.0f\n",
+             blocks, resolution, beam ? "on" : "off",
+             res.mean_ms, res.p50_ms, res.p95_ms, res.draw_calls, res.vertices, res.drawn, res.culled);
+    }
+  }
+
+  quitOffscreen();
+  return 0;
+}
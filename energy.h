@@ -0,0 +1,73 @@
+/* Cannon battery as a function of simulation time.
+ * Between trigger changes the charge moves at a constant rate, so a
+ * battery only keeps its charge at the last change, the time of it and the
+ * rate; the charge at any later time is that line clamped to [0, 1]. No
+ * step is taken per tick. The game reads the charge when a cannon fires,
+ * and the level shown on the battery (the charge in battery_levels steps)
+ * changes by an event scheduled for when the line crosses the next step.
+ */
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <algorithm>
+#include <cmath>
+
+const int battery_levels = 32;        // steps on the gauge
+const float battery_recharge = 0.45f; // charge per second, always on
+const float battery_drain = 1.05f;    // charge per second while firing
+const double battery_never = 1e300;   // no event due
+
+struct Battery {
+  double t0;    // time of the last rate change
+  float e0;     // charge at t0, 0 (flat) to 1 (full)
+  float rate;   // charge per second since t0
+  double next;  // when 'shown' next changes
+  int shown;    // level on the gauge, 0 to battery_levels
+};
+
+inline float battery_charge (const Battery &B, double t)
+{
+  return std::min(1.0f, std::max(0.0f, (float)(B.e0 + B.rate * (t - B.t0))));
+}
+
+inline int battery_level (float e)
+{
+  return std::min(battery_levels, (int)(e * battery_levels));
+}
+
+/* Publish the level at t and find when the line crosses the next step */
+inline void battery_schedule (Battery &B, double t)
+{
+  float e = battery_charge(B, t);
+  B.shown = battery_level(e);
+  B.next = battery_never;
+  if (B.rate > 0 && e < 1) {
+    float step = (float)(B.shown + 1) / battery_levels;
+    B.next = B.t0 + (step - B.e0) / B.rate;
+  }
+  else if (B.rate < 0 && B.shown > 0) {
+    float step = (float)B.shown / battery_levels;
+    B.next = B.t0 + (B.e0 - step) / -B.rate;
+  }
+  B.next = std::max(B.next, t);  // on a step already: the next tick moves off it
+}
+
+/* Start a battery at charge e at time t */
+inline void battery_reset (Battery &B, float e, double t)
+{
+  B.t0 = t, B.e0 = e, B.rate = battery_recharge;
+  battery_schedule(B, t);
+}
+
+/* The trigger changed at t: the line goes on from the charge it reached */
+inline void battery_set_drain (Battery &B, double t, bool draining)
+{
+  B.e0 = battery_charge(B, t);
+  B.t0 = t;
+  B.rate = draining ? battery_recharge - battery_drain : battery_recharge;
+  battery_schedule(B, t);
+}
+
+inline bool battery_draining (const Battery &B) { return B.rate < battery_recharge; }
+
+#endif
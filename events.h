@@ -0,0 +1,64 @@
+/* Gameplay events: hits, catches, misses, game over.
+ * Scoring code only appends a POD record per event to the tick's buffer.
+ * At the end of the tick flush() hands the whole batch to every consumer
+ * in one call each, in the order they subscribed, and empties the buffer.
+ * A consumer costs nothing while the tick runs, however many there are.
+ * Single producer: events are emitted and flushed on the simulation
+ * thread only.
+ */
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+enum GameEventType {
+  EV_HIT,          // the beam went through a piece
+  EV_CATCH,        // a piece fell into the basket of its colour
+  EV_MISS,         // a red or green piece reached the water elsewhere
+  EV_BLACK_WATER,  // a black piece reached the water
+  EV_GAME_OVER,
+  EV_TYPES
+};
+
+struct GameEvent {
+  unsigned char type;   // GameEventType
+  unsigned char color;  // piece colour: 0 red, 1 green, 2 black
+  int points;           // score change
+  float x, y;           // piece corner, or 0
+  int frame;
+};
+
+class EventBus {
+public:
+  typedef void (*Consumer) (const GameEvent *events, int n, void *ctx);
+
+  void subscribe (Consumer f, void *ctx = NULL)
+  {
+    consumers.push_back(std::make_pair(f, ctx));
+  }
+
+  void emit (const GameEvent &e) { buf.push_back(e); }
+
+  /* Every consumer gets this tick's events, then they are dropped */
+  void flush ()
+  {
+    if (buf.empty())
+      return;
+    for (size_t k = 0; k < consumers.size(); k++)
+      consumers[k].first(&buf[0], buf.size(), consumers[k].second);
+    buf.clear();
+  }
+
+  /* Drop this tick's events unseen (a state put back by hand) */
+  void clear () { buf.clear(); }
+
+  int pending () const { return buf.size(); }
+
+private:
+  std::vector<GameEvent> buf;
+  std::vector<std::pair<Consumer, void*> > consumers;
+};
+
+#endif
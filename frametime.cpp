@@ -0,0 +1,238 @@
+/* Frame-time regression harness.
+ * Replays recorded sessions (./sample2D song.mp3 --record file) headlessly
+ * through the same per-tick sequence as sim_step(), with the session's seed
+ * and each tick's recorded input handed in before the tick, and reports frame-time percentiles and per-phase costs. With -b it
+ * compares against a baseline file and exits 1 when any phase's p95
+ * regresses by more than the threshold. It exits 2 on bad arguments or a
+ * session, a file it names or the baseline it cannot read, and 3 when a
+ * replay ends (game over) before the session's recorded end, since its
+ * timings would then not cover the recorded play. The session's option
+ * lines (level, waves, stress, jobs, cannons) set the game up as it was
+ * recorded, and a "load <savestate>" line makes it start from that
+ * mid-game state instead of a fresh game.
+ * Built with -DGL_TRACE (make gltrace) it also reports the GL calls, bytes
+ * uploaded and objects created and deleted per frame, the same for initGL,
+ * and the calls per entry point.
+ *
+ * Usage: ./frametime [-b baseline] [-w baseline_out] [-t percent] [-r repeats] session...
+ */
+#define SAMPLE2D_NO_MAIN
+#include "Sample_GL3_2D.cpp"
+#include "offscreen.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+using namespace std::chrono;
+
+enum Phase { INPUT, BATTERY, TRANSLATE, ROTATE, SHOOT, DRAW, UPDATE, SPAWN, MOUSE, SCORE, REHIT, FRAME, NUM_PHASES };
+const char* phase_names[NUM_PHASES] = {
+  "input", "battery", "translate_", "rotate_canon", "shoot", "draw", "update_blocks", "run_spawner", "mouse", "score_blocks",
+  "recheck_beam", "frame"
+};
+
+vector<double> samples[NUM_PHASES];
+
+/* GL_TRACE builds: per frame counts, in GlFrameStats order */
+enum GlCount { GL_CALLS, GL_UPLOAD, GL_CREATED, GL_DELETED, GL_ERRORS, NUM_GL_COUNTS };
+const char* gl_count_names[NUM_GL_COUNTS] = { "calls", "upload bytes", "created", "deleted", "errors" };
+vector<double> gl_samples[NUM_GL_COUNTS];
+
+void add_gl_sample (const GlFrameStats &g)
+{
+  const long v[NUM_GL_COUNTS] = { g.calls, g.upload_bytes, g.created, g.deleted, g.errors };
+  for(int c = 0; c < NUM_GL_COUNTS; c++)
+    gl_samples[c].push_back(v[c]);
+}
+
+#define TIMED(phase, call) do { \
+    steady_clock::time_point t0 = steady_clock::now(); \
+    call; \
+    samples[phase].push_back(duration<double, micro>(steady_clock::now() - t0).count()); \
+  } while (0)
+
+/* Run one session through sim_step()'s sequence plus a draw, minus window
+   and audio. Returns the frames it ran, or -1 if the level, waves or
+   savestate the session names cannot be loaded. */
+int replay (const Session& s)
+{
+  if (!begin_replay(s))
+    return -1;
+  RenderSnapshot snap;
+
+  size_t next = 0;
+  int frame;
+  for(frame = 0; frame < s.frames; frame++) {
+    steady_clock::time_point start = steady_clock::now();
+
+    replay_input(s, next, frame);
+    TIMED(INPUT, {
+      latch_input();
+      if (tick_click) { checkblock(); checkcanon(); }
+      apply_scroll();
+    });
+    TIMED(BATTERY, update_batteries());
+    L.clear();
+    TIMED(TRANSLATE, translate_());
+    TIMED(ROTATE, { rotate_canon(); control_cannons(); });
+    TIMED(SHOOT, { shoot_mouse(); shoot(); });
+    TIMED(DRAW, { take_snapshot(snap); draw(snap); glFinish(); });
+    TIMED(UPDATE, update_blocks());
+    TIMED(SPAWN, run_spawner());
+    TIMED(MOUSE, { MouseControl_baskets(); MouseControl_canon(); });
+    bool over;
+    TIMED(SCORE, over = score_blocks());
+    if (over) {
+      events.flush();
+      gl_trace_frame();  // a frame not in the samples
+      break;
+    }
+    TIMED(REHIT, recheck_beam());
+    events.flush();
+    frame_no++;
+
+    samples[FRAME].push_back(duration<double, micro>(steady_clock::now() - start).count());
+    if (gl_trace_enabled)
+      add_gl_sample(gl_trace_frame());
+  }
+  return frame;
+}
+
+struct Stats {
+  double mean, p50, p95, p99;
+};
+
+Stats summarize (vector<double> v)
+{
+  Stats st = { 0, 0, 0, 0 };
+  if (v.empty())
+    return st;
+  sort(v.begin(), v.end());
+  for(int i = 0; i < (int)v.size(); i++) st.mean += v[i];
+  st.mean /= v.size();
+  st.p50 = v[v.size() / 2];
+  st.p95 = v[min(v.size() - 1, (size_t)(v.size() * 0.95))];
+  st.p99 = v[min(v.size() - 1, (size_t)(v.size() * 0.99))];
+  return st;
+}
+
+/* Baseline file: one "phase mean p50 p95 p99" line per phase, in microseconds */
+bool loadBaseline (const char* path, map<string, Stats>& base)
+{
+  ifstream in(path);
+  if (!in.is_open()) {
+    fprintf(stderr, "Error: cannot read baseline %s\n", path);
+    return false;
+  }
+  string line;
+  while (getline(in, line)) {
+    char name[64];
+    Stats st;
+    if (line.empty() || line[0] == '#') continue;
+    if (sscanf(line.c_str(), "%63s %lf %lf %lf %lf", name, &st.mean, &st.p50, &st.p95, &st.p99) == 5)
+      base[name] = st;
+  }
+  if (base.empty()) {
+    fprintf(stderr, "Error: no phases in baseline %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+int main (int argc, char** argv)
+{
+  const char* baseline = NULL;
+  const char* write_baseline = NULL;
+  double threshold = 10;   // percent
+  double noise_floor = 2;  // microseconds; smaller p95 deltas are never regressions
+  int repeats = 1;
+  vector<Session> sessions;
+
+  for(int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-b") && i + 1 < argc) baseline = argv[++i];
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc) write_baseline = argv[++i];
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc) threshold = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc) repeats = max(1, atoi(argv[++i]));
+    else if (argv[i][0] != '-') {
+      Session s;
+      if (!load_session(argv[i], s))
+        return 2;
+      sessions.push_back(s);
+    }
+    else {
+      fprintf(stderr, "Usage: %s [-b baseline] [-w baseline_out] [-t percent] [-r repeats] session...\n", argv[0]);
+      return 2;
+    }
+  }
+  if (sessions.empty()) {
+    fprintf(stderr, "Error: no sessions given\n");
+    return 2;
+  }
+  map<string, Stats> base;
+  if (baseline && !loadBaseline(baseline, base))
+    return 2;
+
+  if (!initOffscreen(600, 600))
+    return 2;
+  glViewport(0, 0, 600, 600);
+  initGL(NULL, 600, 600);
+  GlFrameStats startup = gl_trace_frame();
+  gl_trace_clear_totals();
+
+  bool cut_short = false;
+  for(int r = 0; r < repeats; r++) {
+    for(int i = 0; i < (int)sessions.size(); i++) {
+      int frames = replay(sessions[i]);
+      if (frames < 0) {
+        fprintf(stderr, "Error: %s: cannot load the level, waves or savestate it names\n",
+                sessions[i].path.c_str());
+        quitOffscreen();
+        return 2;
+      }
+      printf("%s: %d/%d frames, score %.0f\n", sessions[i].path.c_str(), frames, sessions[i].frames, Score);
+      if (frames < sessions[i].frames) {
+        fprintf(stderr, "Error: %s ended at frame %d of %d; re-record it\n",
+                sessions[i].path.c_str(), frames, sessions[i].frames);
+        cut_short = true;
+      }
+    }
+  }
+
+  FILE* out = write_baseline ? fopen(write_baseline, "w") : NULL;
+  if (out)
+    fprintf(out, "# phase mean p50 p95 p99 (us)\n");
+
+  bool regressed = false;
+  printf("\n%-14s %10s %10s %10s %10s %12s\n", "phase (us)", "mean", "p50", "p95", "p99", "vs baseline");
+  for(int p = 0; p < NUM_PHASES; p++) {
+    Stats st = summarize(samples[p]);
+    printf("%-14s %10.2f %10.2f %10.2f %10.2f", phase_names[p], st.mean, st.p50, st.p95, st.p99);
+    if (base.count(phase_names[p])) {
+      double old = base[phase_names[p]].p95;
+      double change = old > 0 ? 100 * (st.p95 - old) / old : 0;
+      bool bad = change > threshold && st.p95 - old > noise_floor;
+      printf(" %+11.1f%%%s", change, bad ? "  REGRESSION" : "");
+      regressed = regressed || bad;
+    }
+    printf("\n");
+    if (out)
+      fprintf(out, "%s %.3f %.3f %.3f %.3f\n", phase_names[p], st.mean, st.p50, st.p95, st.p99);
+  }
+  if (out)
+    fclose(out);
+
+  if (gl_trace_enabled) {
+    printf("\n%-14s %10s %10s %10s %10s %12s\n", "GL per frame", "mean", "p50", "p95", "p99", "initGL");
+    const long init[NUM_GL_COUNTS] = { startup.calls, startup.upload_bytes, startup.created, startup.deleted, startup.errors };
+    for(int c = 0; c < NUM_GL_COUNTS; c++) {
+      Stats st = summarize(gl_samples[c]);
+      printf("%-14s %10.1f %10.0f %10.0f %10.0f %12ld\n", gl_count_names[c], st.mean, st.p50, st.p95, st.p99, init[c]);
+    }
+    printf("\n");
+    gl_trace_report(stdout, gl_samples[GL_CALLS].size());
+  }
+
+  quitOffscreen();
+  return cut_short ? 3 : regressed ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+/* Every GL entry point the game and the tools call, for the loader in
+ * glad_min.c and the call counting in gl_trace.h:
+ *   X(return type, name without gl, parameters, arguments, accounting)
+ * where accounting is what gl_trace.h adds up for the call (0 if nothing).
+ * A GL function used anywhere else must be added here; with glad_min.c a
+ * missing one fails to link as an undefined glad_gl* pointer. glGetError
+ * is loaded separately since the call counting calls it itself.
+ */
+#ifndef GL_ENTRY_POINTS_H
+#define GL_ENTRY_POINTS_H
+
+#define GL_ENTRY_POINTS(X) \
+  X(void, AttachShader, (GLuint program, GLuint shader), (program, shader), 0) \
+  X(void, BindBuffer, (GLenum target, GLuint buffer), (target, buffer), 0) \
+  X(void, BindTexture, (GLenum target, GLuint texture), (target, texture), 0) \
+  X(void, BindVertexArray, (GLuint array), (array), 0) \
+  X(void, BufferData, (GLenum target, GLsizeiptr size, const void *data, GLenum usage), \
+    (target, size, data, usage), gl_trace.frame.upload_bytes += size) \
+  X(void, BufferSubData, (GLenum target, GLintptr offset, GLsizeiptr size, const void *data), \
+    (target, offset, size, data), gl_trace.frame.upload_bytes += size) \
+  X(void, Clear, (GLbitfield mask), (mask), 0) \
+  X(void, ClearColor, (GLfloat r, GLfloat g, GLfloat b, GLfloat a), (r, g, b, a), 0) \
+  X(void, ClearDepth, (GLdouble depth), (depth), 0) \
+  X(void, CompileShader, (GLuint shader), (shader), 0) \
+  X(GLuint, CreateProgram, (void), (), gl_trace.frame.created++) \
+  X(GLuint, CreateShader, (GLenum type), (type), gl_trace.frame.created++) \
+  X(void, DeleteBuffers, (GLsizei n, const GLuint *buffers), (n, buffers), gl_trace.frame.deleted += n) \
+  X(void, DeleteProgram, (GLuint program), (program), gl_trace.frame.deleted++) \
+  X(void, DeleteShader, (GLuint shader), (shader), gl_trace.frame.deleted++) \
+  X(void, DeleteTextures, (GLsizei n, const GLuint *textures), (n, textures), gl_trace.frame.deleted += n) \
+  X(void, DeleteVertexArrays, (GLsizei n, const GLuint *arrays), (n, arrays), gl_trace.frame.deleted += n) \
+  X(void, DepthFunc, (GLenum func), (func), 0) \
+  X(void, DrawArrays, (GLenum mode, GLint first, GLsizei count), (mode, first, count), 0) \
+  X(void, Enable, (GLenum cap), (cap), 0) \
+  X(void, EnableVertexAttribArray, (GLuint index), (index), 0) \
+  X(void, Finish, (void), (), 0) \
+  X(void, GenBuffers, (GLsizei n, GLuint *buffers), (n, buffers), gl_trace.frame.created += n) \
+  X(void, GenTextures, (GLsizei n, GLuint *textures), (n, textures), gl_trace.frame.created += n) \
+  X(void, GenVertexArrays, (GLsizei n, GLuint *arrays), (n, arrays), gl_trace.frame.created += n) \
+  X(void, GetProgramInfoLog, (GLuint program, GLsizei size, GLsizei *length, GLchar *log), \
+    (program, size, length, log), 0) \
+  X(void, GetProgramiv, (GLuint program, GLenum pname, GLint *params), (program, pname, params), 0) \
+  X(void, GetShaderInfoLog, (GLuint shader, GLsizei size, GLsizei *length, GLchar *log), \
+    (shader, size, length, log), 0) \
+  X(void, GetShaderiv, (GLuint shader, GLenum pname, GLint *params), (shader, pname, params), 0) \
+  X(const GLubyte *, GetString, (GLenum name), (name), 0) \
+  X(GLint, GetUniformLocation, (GLuint program, const GLchar *name), (program, name), 0) \
+  X(void, LinkProgram, (GLuint program), (program), 0) \
+  X(void, PixelStorei, (GLenum pname, GLint param), (pname, param), 0) \
+  X(void, PolygonMode, (GLenum face, GLenum mode), (face, mode), 0) \
+  X(void, ReadPixels, (GLint x, GLint y, GLsizei w, GLsizei h, GLenum format, GLenum type, void *pixels), \
+    (x, y, w, h, format, type, pixels), 0) \
+  X(void, ShaderSource, (GLuint shader, GLsizei count, const GLchar *const *string, const GLint *length), \
+    (shader, count, string, length), 0) \
+  X(void, TexImage2D, (GLenum target, GLint level, GLint internalformat, GLsizei w, GLsizei h, GLint border, \
+                       GLenum format, GLenum type, const void *pixels), \
+    (target, level, internalformat, w, h, border, format, type, pixels), 0) \
+  X(void, TexParameteri, (GLenum target, GLenum pname, GLint param), (target, pname, param), 0) \
+  X(void, UniformMatrix4fv, (GLint location, GLsizei count, GLboolean transpose, const GLfloat *value), \
+    (location, count, transpose, value), 0) \
+  X(void, UseProgram, (GLuint program), (program), 0) \
+  X(void, VertexAttribPointer, (GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, \
+                                const void *pointer), (index, size, type, normalized, stride, pointer), 0) \
+  X(void, Viewport, (GLint x, GLint y, GLsizei w, GLsizei h), (x, y, w, h), 0)
+
+#endif
@@ -0,0 +1,135 @@
+/* GL call accounting for builds with -DGL_TRACE (make gltrace).
+ * glad calls GL through function pointers: glDrawArrays is the variable
+ * glad_glDrawArrays. gl_trace_install(), run once the loader has filled
+ * them in, points every entry point in gl_entry_points.h at a wrapper that
+ * counts the call, calls the driver and then checks glGetError, so nothing
+ * in the game changes. glBufferData and glBufferSubData add their sizes to the
+ * bytes uploaded, glGen and glCreate count objects created, glDelete counts
+ * objects deleted. gl_trace_frame() returns what was counted since it last
+ * ran and starts a new frame. Calls and errors are also totalled per entry
+ * point for gl_trace_report(). GL is only called from the main thread.
+ * Without GL_TRACE all of it is an empty inline.
+ */
+#ifndef GL_TRACE_H
+#define GL_TRACE_H
+
+#include <cstdio>
+
+struct GlFrameStats {
+  long calls, upload_bytes, created, deleted, errors;
+};
+
+#ifdef GL_TRACE
+
+#include <algorithm>
+#include <vector>
+
+#include "gl_entry_points.h"
+
+const bool gl_trace_enabled = true;
+
+#define GL_TRACE_ID(ret, name, params, args, account) GLT_##name,
+enum GlTraceEntry { GL_ENTRY_POINTS(GL_TRACE_ID) GLT_COUNT };
+#undef GL_TRACE_ID
+
+#define GL_TRACE_NAME(ret, name, params, args, account) "gl" #name,
+const char *const gl_trace_names[GLT_COUNT] = { GL_ENTRY_POINTS(GL_TRACE_NAME) };
+#undef GL_TRACE_NAME
+
+struct GlTrace {
+  GlFrameStats frame;              // since the last gl_trace_frame()
+  long calls[GLT_COUNT];           // since install or gl_trace_clear_totals()
+  long errors[GLT_COUNT];
+  int reported;                    // errors written to stderr so far
+} gl_trace;
+
+/* Counts the call on entry; on leaving, after the driver ran, checks for
+   an error. The first few are written out with the entry point's name. */
+struct GlTraceCall {
+  int entry;
+
+  GlTraceCall (int entry) : entry(entry)
+  {
+    gl_trace.frame.calls++;
+    gl_trace.calls[entry]++;
+  }
+
+  ~GlTraceCall ()
+  {
+    GLenum error = glad_glGetError();
+    if (error == GL_NO_ERROR)
+      return;
+    gl_trace.frame.errors++;
+    gl_trace.errors[entry]++;
+    if (gl_trace.reported++ < 20)
+      fprintf(stderr, "GL error 0x%04x in %s\n", error, gl_trace_names[entry]);
+  }
+};
+
+#define GL_TRACE_WRAPPER(ret, name, params, args, account) \
+  static decltype(glad_gl##name) gl_trace_driver_##name; \
+  static ret APIENTRY gl_trace_##name params \
+  { \
+    GlTraceCall call(GLT_##name); \
+    (void)(account); \
+    return gl_trace_driver_##name args; \
+  }
+GL_ENTRY_POINTS(GL_TRACE_WRAPPER)
+#undef GL_TRACE_WRAPPER
+
+/* Put the wrappers in front of the loaded entry points. Safe to call again
+   after the loader ran again; entry points the driver lacks stay NULL. */
+inline void gl_trace_install ()
+{
+#define GL_TRACE_HOOK(ret, name, params, args, account) \
+  if (glad_gl##name && glad_gl##name != gl_trace_##name) { \
+    gl_trace_driver_##name = glad_gl##name; \
+    glad_gl##name = gl_trace_##name; \
+  }
+  GL_ENTRY_POINTS(GL_TRACE_HOOK)
+#undef GL_TRACE_HOOK
+}
+
+inline GlFrameStats gl_trace_frame ()
+{
+  GlFrameStats s = gl_trace.frame;
+  gl_trace.frame = GlFrameStats();
+  return s;
+}
+
+/* Start the per entry point totals over (say after startup) */
+inline void gl_trace_clear_totals ()
+{
+  std::fill(gl_trace.calls, gl_trace.calls + GLT_COUNT, 0L);
+  std::fill(gl_trace.errors, gl_trace.errors + GLT_COUNT, 0L);
+}
+
+/* Calls per entry point since the totals started, most called first, and
+   their average over 'frames' */
+inline void gl_trace_report (FILE *out, long frames)
+{
+  std::vector<std::pair<long, int> > order;
+  for(int k = 0; k < GLT_COUNT; k++)
+    if (gl_trace.calls[k])
+      order.push_back(std::make_pair(-gl_trace.calls[k], k));
+  std::sort(order.begin(), order.end());
+  fprintf(out, "%-26s %10s %10s %8s\n", "GL entry point", "calls", "per frame", "errors");
+  for(size_t i = 0; i < order.size(); i++) {
+    int k = order[i].second;
+    fprintf(out, "%-26s %10ld %10.2f %8ld\n", gl_trace_names[k], gl_trace.calls[k],
+            frames ? (double)gl_trace.calls[k] / frames : 0.0, gl_trace.errors[k]);
+  }
+}
+
+#else
+
+const bool gl_trace_enabled = false;
+
+inline void gl_trace_install () {}
+inline GlFrameStats gl_trace_frame () { return GlFrameStats(); }
+inline void gl_trace_clear_totals () {}
+inline void gl_trace_report (FILE *, long) {}
+
+#endif
+
+#endif
@@ -0,0 +1,42 @@
+/* Minimal GL loader, linked instead of glad.c (make LOADER=glad.c for the
+ * full one). It gives the same interface, glad/glad.h and
+ * gladLoadGLLoader(), for only the entry points in gl_entry_points.h.
+ * glad.c resolves every GL 4.5 function and every extension it knows
+ * (thousands of lookups plus an extension string scan) before the first
+ * frame; this resolves the few dozen the game calls. Desktop GL only.
+ * Fails, naming it, if the driver lacks one of them.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <glad/glad.h>
+
+#include "gl_entry_points.h"
+
+struct gladGLversionStruct GLVersion;
+
+#define GLAD_MIN_POINTER(ret, name, params, args, account) ret (APIENTRYP glad_gl##name) params = NULL;
+GL_ENTRY_POINTS(GLAD_MIN_POINTER)
+#undef GLAD_MIN_POINTER
+PFNGLGETERRORPROC glad_glGetError = NULL;
+
+int gladLoadGLLoader (GLADloadproc load)
+{
+  int missing = 0;
+  GLVersion.major = GLVersion.minor = 0;
+#define GLAD_MIN_LOAD(ret, name, params, args, account) \
+  if (!(glad_gl##name = (ret (APIENTRYP) params) load("gl" #name))) { \
+    fprintf(stderr, "Error: GL driver has no gl" #name "\n"); \
+    missing++; \
+  }
+  GL_ENTRY_POINTS(GLAD_MIN_LOAD)
+#undef GLAD_MIN_LOAD
+  if (!(glad_glGetError = (PFNGLGETERRORPROC) load("glGetError")))
+    missing++;
+  if (missing)
+    return 0;
+
+  const char *version = (const char*) glad_glGetString(GL_VERSION);
+  if (!version || sscanf(version, "%d.%d", &GLVersion.major, &GLVersion.minor) != 2)
+    return 0;
+  return 1;
+}
@@ -0,0 +1,95 @@
+/* 5x7 bitmap font for the HUD and the atlas texture built from it.
+ * Digits, capitals (lower case is drawn as capitals) and the few signs the
+ * HUD prints; anything else is drawn as a space. '#' is a solid cell, which
+ * bars and graphs sample to draw filled quads. The atlas is one row of
+ * cells, one byte per texel, 255 where a glyph is lit.
+ */
+#ifndef HUD_FONT_H
+#define HUD_FONT_H
+
+#include <cstring>
+#include <vector>
+
+const int glyph_w = 5, glyph_h = 7;   // lit area
+const int cell_w = 6, cell_h = 8;     // with a blank column and row
+
+const char hud_glyph_chars[] = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:%-/!#";
+const int hud_glyphs = sizeof hud_glyph_chars - 1;
+
+/* Rows top to bottom, '#' lit */
+const char *const hud_glyph_rows[hud_glyphs][glyph_h] = {
+  { ".....", ".....", ".....", ".....", ".....", ".....", "....." },  // space
+  { ".###.", "#...#", "#..##", "#.#.#", "##..#", "#...#", ".###." },  // 0
+  { "..#..", ".##..", "..#..", "..#..", "..#..", "..#..", ".###." },
+  { ".###.", "#...#", "....#", "...#.", "..#..", ".#...", "#####" },
+  { "#####", "...#.", "..#..", "...#.", "....#", "#...#", ".###." },
+  { "...#.", "..##.", ".#.#.", "#..#.", "#####", "...#.", "...#." },
+  { "#####", "#....", "####.", "....#", "....#", "#...#", ".###." },
+  { "..##.", ".#...", "#....", "####.", "#...#", "#...#", ".###." },
+  { "#####", "....#", "...#.", "..#..", ".#...", ".#...", ".#..." },
+  { ".###.", "#...#", "#...#", ".###.", "#...#", "#...#", ".###." },
+  { ".###.", "#...#", "#...#", ".####", "....#", "...#.", ".##.." },  // 9
+  { ".###.", "#...#", "#...#", "#####", "#...#", "#...#", "#...#" },  // A
+  { "####.", "#...#", "#...#", "####.", "#...#", "#...#", "####." },
+  { ".###.", "#...#", "#....", "#....", "#....", "#...#", ".###." },
+  { "###..", "#..#.", "#...#", "#...#", "#...#", "#..#.", "###.." },
+  { "#####", "#....", "#....", "####.", "#....", "#....", "#####" },
+  { "#####", "#....", "#....", "####.", "#....", "#....", "#...." },
+  { ".###.", "#...#", "#....", "#.###", "#...#", "#...#", ".####" },
+  { "#...#", "#...#", "#...#", "#####", "#...#", "#...#", "#...#" },
+  { ".###.", "..#..", "..#..", "..#..", "..#..", "..#..", ".###." },
+  { "..###", "...#.", "...#.", "...#.", "...#.", "#..#.", ".##.." },
+  { "#...#", "#..#.", "#.#..", "##...", "#.#..", "#..#.", "#...#" },
+  { "#....", "#....", "#....", "#....", "#....", "#....", "#####" },
+  { "#...#", "##.##", "#.#.#", "#.#.#", "#...#", "#...#", "#...#" },
+  { "#...#", "#...#", "##..#", "#.#.#", "#..##", "#...#", "#...#" },
+  { ".###.", "#...#", "#...#", "#...#", "#...#", "#...#", ".###." },
+  { "####.", "#...#", "#...#", "####.", "#....", "#....", "#...." },
+  { ".###.", "#...#", "#...#", "#...#", "#.#.#", "#..#.", ".##.#" },
+  { "####.", "#...#", "#...#", "####.", "#.#..", "#..#.", "#...#" },
+  { ".####", "#....", "#....", ".###.", "....#", "....#", "####." },
+  { "#####", "..#..", "..#..", "..#..", "..#..", "..#..", "..#.." },
+  { "#...#", "#...#", "#...#", "#...#", "#...#", "#...#", ".###." },
+  { "#...#", "#...#", "#...#", "#...#", "#...#", ".#.#.", "..#.." },
+  { "#...#", "#...#", "#...#", "#.#.#", "#.#.#", "#.#.#", ".#.#." },
+  { "#...#", "#...#", ".#.#.", "..#..", ".#.#.", "#...#", "#...#" },
+  { "#...#", "#...#", ".#.#.", "..#..", "..#..", "..#..", "..#.." },
+  { "#####", "....#", "...#.", "..#..", ".#...", "#....", "#####" },  // Z
+  { ".....", ".....", ".....", ".....", ".....", ".##..", ".##.." },  // .
+  { ".....", ".##..", ".##..", ".....", ".##..", ".##..", "....." },  // :
+  { "##...", "##..#", "...#.", "..#..", ".#...", "#..##", "...##" },  // %
+  { ".....", ".....", ".....", "#####", ".....", ".....", "....." },  // -
+  { ".....", "....#", "...#.", "..#..", ".#...", "#....", "....." },  // /
+  { "..#..", "..#..", "..#..", "..#..", "..#..", ".....", "..#.." },  // !
+  { "#####", "#####", "#####", "#####", "#####", "#####", "#####" },  // # solid
+};
+
+/* Atlas cell of character c */
+inline int hud_glyph (char c)
+{
+  if (c >= 'a' && c <= 'z')
+    c -= 'a' - 'A';
+  const char *p = c ? strchr(hud_glyph_chars, c) : NULL;
+  return p ? p - hud_glyph_chars : 0;
+}
+
+/* Atlas coordinates of a lit texel, the middle of the solid cell */
+inline void hud_solid_texel (float &u, float &v)
+{
+  u = (hud_glyph('#') * cell_w + 2.5f) / (hud_glyphs * cell_w);
+  v = 4.5f / cell_h;
+}
+
+/* hud_glyphs cells side by side, row 0 at the bottom as GL expects */
+inline void build_font_atlas (std::vector<unsigned char> &texels, int &width, int &height)
+{
+  width = hud_glyphs * cell_w, height = cell_h;
+  texels.assign(width * height, 0);
+  for (int g = 0; g < hud_glyphs; g++)
+    for (int row = 0; row < glyph_h; row++)
+      for (int col = 0; col < glyph_w; col++)
+        if (hud_glyph_rows[g][row][col] == '#')
+          texels[(cell_h - 1 - row) * width + g * cell_w + col] = 255;
+}
+
+#endif
@@ -0,0 +1,168 @@
+/* Small work-stealing job system for the data-parallel parts of a tick.
+ * Every worker owns a deque of index ranges. A worker runs ranges from
+ * the back of its own deque, splitting big ones in half and pushing the
+ * upper half back for others; idle workers steal from the front of
+ * someone else's deque. The thread calling parallel_for is worker 0 and
+ * helps until the whole range is done, so one caller at a time. */
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobSystem {
+  struct Range {
+    void (*fn)(void*, int, int);
+    void *ctx;
+    int begin, end, grain;
+  };
+  struct Queue {
+    std::mutex m;
+    std::deque<Range> ranges;
+  };
+
+  std::vector<std::thread> threads;
+  std::vector<Queue*> queues;
+  std::atomic<bool> running;
+  std::atomic<int> pending;   // ranges queued or running for the current parallel_for
+  std::atomic<unsigned> epoch; // bumped to wake sleeping workers
+  std::mutex sleep_m;
+  std::condition_variable wake;
+
+  template <class F>
+  static void trampoline (void *ctx, int begin, int end) { (*(F*)ctx)(begin, end); }
+
+  void push (int self, const Range &r)
+  {
+    pending++;
+    {
+      std::lock_guard<std::mutex> lock(queues[self]->m);
+      queues[self]->ranges.push_back(r);
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleep_m);
+      epoch++;
+    }
+    wake.notify_all();
+  }
+
+  bool pop (int self, Range &r)
+  {
+    std::lock_guard<std::mutex> lock(queues[self]->m);
+    if (queues[self]->ranges.empty())
+      return false;
+    r = queues[self]->ranges.back();
+    queues[self]->ranges.pop_back();
+    return true;
+  }
+
+  bool steal (int self, Range &r)
+  {
+    int n = queues.size();
+    for(int k = 1; k < n; k++) {
+      Queue *q = queues[(self + k) % n];
+      std::lock_guard<std::mutex> lock(q->m);
+      if (!q->ranges.empty()) {
+        r = q->ranges.front();
+        q->ranges.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Split off upper halves until the range is one grain, then run it */
+  void execute (int self, Range r)
+  {
+    while (r.end - r.begin > r.grain) {
+      int mid = r.begin + (r.end - r.begin) / 2;
+      Range upper = r;
+      upper.begin = mid;
+      push(self, upper);
+      r.end = mid;
+    }
+    r.fn(r.ctx, r.begin, r.end);
+    pending--;
+  }
+
+  bool run_one (int self)
+  {
+    Range r;
+    if (pop(self, r) || steal(self, r)) {
+      execute(self, r);
+      return true;
+    }
+    return false;
+  }
+
+  void worker (int self)
+  {
+    while (running) {
+      unsigned seen = epoch;
+      if (run_one(self))
+        continue;
+      std::unique_lock<std::mutex> lock(sleep_m);
+      wake.wait(lock, [&] { return !running || epoch != seen; });
+    }
+  }
+
+public:
+  JobSystem () : running(false), pending(0), epoch(0) { queues.push_back(new Queue); }
+  ~JobSystem () { stop(); delete queues[0]; }
+
+  /* Use 'count' threads in total, including the caller */
+  void start (int count)
+  {
+    stop();
+    for(int i = 1; i < count; i++)
+      queues.push_back(new Queue);
+    running = true;
+    for(int i = 1; i < count; i++)
+      threads.push_back(std::thread(&JobSystem::worker, this, i));
+  }
+
+  void stop ()
+  {
+    if (!running)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(sleep_m);
+      running = false;
+    }
+    wake.notify_all();
+    for(int i = 0; i < (int)threads.size(); i++)
+      threads[i].join();
+    threads.clear();
+    for(int i = 1; i < (int)queues.size(); i++)
+      delete queues[i];
+    queues.resize(1);
+  }
+
+  int workers () const { return queues.size(); }
+
+  /* f(begin, end) over [begin, end) in chunks of at most 'grain'.
+     Runs inline when there is only one worker or one chunk. */
+  template <class F>
+  void parallel_for (int begin, int end, int grain, F f)
+  {
+    if (grain < 1)
+      grain = 1;
+    if (queues.size() == 1 || end - begin <= grain) {
+      if (begin < end)
+        f(begin, end);
+      return;
+    }
+    Range r = { &trampoline<F>, &f, begin, end, grain };
+    pending++;
+    execute(0, r);
+    while (pending > 0)
+      if (!run_one(0))
+        std::this_thread::yield();
+  }
+};
+
+#endif
@@ -0,0 +1,325 @@
+/* Level files: mirrors, baskets, water line, spawn range, cannon limits
+ * and scoring.
+ *
+ * A level is a fixed-size POD header followed by its mirrors, any number
+ * of them. Compiled (by levelc) it is written out byte for byte, so loading
+ * reads the file into memory, checks it and uses the records as they lie:
+ * no parsing. It is read(), not mapped: a zero-copy mapping would fault
+ * (SIGBUS) if the .bin were cut short in place while in use, and a level
+ * is small enough that the copy costs nothing. The binary is native layout and carries sizeof(Level), so a
+ * file from a build with another layout is refused. The text source, one
+ * setting per line, loads too (parsed into a record):
+ *
+ *   mirror <x1> <y1> <x2> <y2> <angle deg>   reflecting edge
+ *   mirrors 0                                no mirrors at all
+ *   baskets <red x> <green x>                start positions
+ *   basket_range <red min> <red max> <green min> <green max>
+ *   basket_step <units per tick>
+ *   water <y>                                blocks below it are scored
+ *   spawn_x <min> <max>                      column of the endless game
+ *   gapy <units>                             space between column blocks
+ *   cannon <min y> <max y> <units per tick>
+ *   turn <max angle deg> <radians per tick>
+ *   score <black shot> <other shot> <caught> <black in water>
+ *
+ * Settings not given keep their defaults; any mirror line replaces the
+ * default mirrors. LevelWatch reports when the file was rewritten
+ * (inotify) so the game can reload it in place.
+ */
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+const int max_mirrors = 1 << 20;
+
+struct LevelMirror {
+  float x1, y1, x2, y2;  // reflecting edge
+  float angle;           // radians, as the reflection uses it
+};
+
+struct Level {
+  char magic[8];         // "BSLEVL2"
+  unsigned size;         // sizeof(Level)
+  int mirrors;           // LevelMirror records right after the header
+  float basket_start[2];
+  float basket_min[2], basket_max[2];
+  float basket_step;
+  float water_line;
+  float spawn_xmin, spawn_xmax;
+  float gapy;
+  float cannon_min, cannon_max, cannon_step;
+  float turn_limit, turn_step;
+  int score_black_shot, score_other_shot, score_caught, score_black_water;
+};
+
+inline const LevelMirror* level_mirrors (const Level *l) { return (const LevelMirror*)(l + 1); }
+
+inline size_t level_bytes (const Level *l) { return sizeof(Level) + l->mirrors * sizeof(LevelMirror); }
+
+/* Header and mirrors as one record in 'buf' */
+inline const Level* pack_level (const Level &l, const LevelMirror *mirrors, std::vector<char> &buf)
+{
+  buf.resize(sizeof(Level) + l.mirrors * sizeof(LevelMirror));
+  memcpy(&buf[0], &l, sizeof l);
+  if (l.mirrors)
+    memcpy(&buf[sizeof l], mirrors, l.mirrors * sizeof(LevelMirror));
+  return (const Level*)&buf[0];
+}
+
+/* The original hard-coded board: header, and its mirrors in 'mirrors' */
+inline Level default_level (std::vector<LevelMirror> &mirrors)
+{
+  Level l;
+  memset(&l, 0, sizeof l);
+  memcpy(l.magic, "BSLEVL2", 8);
+  l.size = sizeof(Level);
+  l.mirrors = 3;
+  LevelMirror m1 = { -12, -10, (float)(-12+10*cos(M_PI/4)), (float)(-10+8*cos(M_PI/4)), (float)(M_PI/4) };
+  LevelMirror m2 = { 32, 30, (float)(32-9*cos(M_PI/3)), (float)(30+9*sin(M_PI/3)), (float)(2*M_PI/3) };
+  LevelMirror m3 = { 25, -20, (float)(25+10*cos(M_PI/3)), (float)(-20+10*sin(M_PI/3)), (float)(M_PI/3) };
+  mirrors.clear();
+  mirrors.push_back(m1), mirrors.push_back(m2), mirrors.push_back(m3);
+  l.basket_start[0] = l.basket_start[1] = 0;
+  l.basket_min[0] = -32, l.basket_max[0] = 46;
+  l.basket_min[1] = -46, l.basket_max[1] = 32;
+  l.basket_step = 0.3;
+  l.water_line = -37;
+  l.spawn_xmin = -20, l.spawn_xmax = 29;
+  l.gapy = 10;
+  l.cannon_min = -37, l.cannon_max = 37, l.cannon_step = 0.3;
+  l.turn_limit = M_PI/2, l.turn_step = 0.03;
+  l.score_black_shot = 100, l.score_other_shot = -10;
+  l.score_caught = 100, l.score_black_water = -100;
+  return l;
+}
+
+/* Every setting and mirror coordinate is a finite number; mirrors must
+   lie within the record */
+inline bool level_finite (const Level &l)
+{
+  const float v[] = {
+    l.basket_start[0], l.basket_start[1], l.basket_min[0], l.basket_min[1], l.basket_max[0], l.basket_max[1],
+    l.basket_step, l.water_line, l.spawn_xmin, l.spawn_xmax, l.gapy,
+    l.cannon_min, l.cannon_max, l.cannon_step, l.turn_limit, l.turn_step
+  };
+  for (size_t k = 0; k < sizeof v / sizeof *v; k++)
+    if (!std::isfinite(v[k]))
+      return false;
+  const LevelMirror *m = level_mirrors(&l);
+  for (int k = 0; k < l.mirrors; k++)
+    if (!std::isfinite(m[k].x1) || !std::isfinite(m[k].y1) || !std::isfinite(m[k].x2)
+        || !std::isfinite(m[k].y2) || !std::isfinite(m[k].angle))
+      return false;
+  return true;
+}
+
+/* Ranges that would break the game, or a record longer than its 'bytes';
+   prints why and returns false */
+inline bool check_level (const Level &l, size_t bytes, const char *path)
+{
+  const char *why = NULL;
+  if (memcmp(l.magic, "BSLEVL2", 8) || l.size != sizeof(Level)) why = "not a level of this build";
+  else if (l.mirrors < 0 || l.mirrors > max_mirrors) why = "too many mirrors";
+  else if (bytes < level_bytes(&l)) why = "truncated";
+  else if (!level_finite(l)) why = "a setting or mirror is not a finite number";
+  else if (l.basket_step <= 0 || l.cannon_step <= 0 || l.turn_step <= 0) why = "step not greater than 0";
+  else if (l.basket_min[0] > l.basket_max[0] || l.basket_min[1] > l.basket_max[1]) why = "empty basket range";
+  else if (l.spawn_xmin > l.spawn_xmax) why = "empty spawn range";
+  else if (l.cannon_min > l.cannon_max) why = "empty cannon range";
+  else if (l.gapy < 0) why = "negative gapy";
+  if (why)
+    fprintf(stderr, "Error: %s: %s\n", path, why);
+  return !why;
+}
+
+/* Text source into a packed record in 'buf' (defaults first). Returns
+   false on a bad line. */
+inline bool parse_level (const char *text, size_t len, std::vector<char> &buf, const char *path)
+{
+  std::vector<LevelMirror> defaults, mirrors;
+  Level l = default_level(defaults);
+  bool named = false;  // any mirror line replaces the defaults
+  std::string src(text, len);
+  size_t pos = 0;
+  while (pos < src.size()) {
+    size_t eol = src.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = src.size();
+    std::string line = src.substr(pos, eol - pos);
+    pos = eol + 1;
+    const char *s = line.c_str();
+    while (*s == ' ' || *s == '\t') s++;
+    if (!*s || *s == '#' || *s == '\r')
+      continue;
+    char key[32];
+    float a, b, c, d, e;
+    int n = sscanf(s, "%31s %f %f %f %f %f", key, &a, &b, &c, &d, &e) - 1;
+    bool ok = true;
+    if (!strcmp(key, "mirror") && (ok = n == 5 && (int)mirrors.size() < max_mirrors)) {
+      LevelMirror m = { a, b, c, d, (float)(e * M_PI / 180) };
+      mirrors.push_back(m);
+      named = true;
+    }
+    else if (!strcmp(key, "mirrors") && (ok = n == 1 && a == 0))
+      mirrors.clear(), named = true;
+    else if (!strcmp(key, "baskets") && (ok = n == 2))
+      l.basket_start[0] = a, l.basket_start[1] = b;
+    else if (!strcmp(key, "basket_range") && (ok = n == 4))
+      l.basket_min[0] = a, l.basket_max[0] = b, l.basket_min[1] = c, l.basket_max[1] = d;
+    else if (!strcmp(key, "basket_step") && (ok = n == 1))
+      l.basket_step = a;
+    else if (!strcmp(key, "water") && (ok = n == 1))
+      l.water_line = a;
+    else if (!strcmp(key, "spawn_x") && (ok = n == 2))
+      l.spawn_xmin = a, l.spawn_xmax = b;
+    else if (!strcmp(key, "gapy") && (ok = n == 1))
+      l.gapy = a;
+    else if (!strcmp(key, "cannon") && (ok = n == 3))
+      l.cannon_min = a, l.cannon_max = b, l.cannon_step = c;
+    else if (!strcmp(key, "turn") && (ok = n == 2))
+      l.turn_limit = a * M_PI / 180, l.turn_step = b;
+    else if (!strcmp(key, "score") && (ok = n == 4))
+      l.score_black_shot = a, l.score_other_shot = b, l.score_caught = c, l.score_black_water = d;
+    else
+      ok = false;
+    if (!ok) {
+      fprintf(stderr, "Error: %s: bad level line: %s\n", path, s);
+      return false;
+    }
+  }
+  if (!named)
+    mirrors = defaults;
+  l.mirrors = mirrors.size();
+  const Level *packed = pack_level(l, mirrors.empty() ? NULL : &mirrors[0], buf);
+  return check_level(*packed, buf.size(), path);
+}
+
+/* A loaded level: 'level' points into 'record', a compiled file's bytes
+   as copied out or a text file parsed */
+struct LevelFile {
+  const Level *level;
+  std::vector<char> record;
+
+  LevelFile () : level(NULL) {}
+  ~LevelFile () { close(); }
+
+  bool load (const char *path)
+  {
+    close();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Error: cannot read level %s\n", path);
+      return false;
+    }
+    std::vector<char> bytes;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+      bytes.reserve(st.st_size);
+    char buf[65536];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof buf)) > 0)
+      bytes.insert(bytes.end(), buf, buf + len);
+    ::close(fd);
+    if (len < 0 || bytes.empty()) {
+      fprintf(stderr, "Error: cannot read level %s\n", path);
+      return false;
+    }
+    bool ok;
+    if (bytes.size() >= 8 && !memcmp(&bytes[0], "BSLEVL", 6)) {
+      record.swap(bytes);
+      ok = record.size() >= sizeof(Level);
+      if (!ok)
+        fprintf(stderr, "Error: %s: truncated\n", path);
+      ok = ok && check_level(*(const Level*)&record[0], record.size(), path);
+    }
+    else
+      ok = parse_level(&bytes[0], bytes.size(), record, path);
+    if (ok)
+      level = (const Level*)&record[0];
+    else
+      close();
+    return ok;
+  }
+
+  void close ()
+  {
+    record.clear();
+    level = NULL;
+  }
+
+private:
+  LevelFile (const LevelFile&);
+  LevelFile& operator= (const LevelFile&);
+};
+
+/* Notices when a level file is rewritten. Watches its directory, since
+   editors often save by writing a new file and renaming it over the old.
+   Linux only (inotify); elsewhere start() warns and nothing reloads. */
+class LevelWatch {
+  int fd, wd;
+  std::string name;
+
+public:
+  LevelWatch () : fd(-1), wd(-1) {}
+  ~LevelWatch () { stop(); }
+
+  bool start (const char *path)
+  {
+    stop();
+    std::string p(path);
+    size_t slash = p.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : p.substr(0, slash + 1);
+    name = slash == std::string::npos ? p : p.substr(slash + 1);
+#ifdef __linux__
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0)
+      wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+#endif
+    if (wd < 0) {
+      fprintf(stderr, "Warning: cannot watch %s for changes\n", path);
+      stop();
+      return false;
+    }
+    return true;
+  }
+
+  void stop ()
+  {
+    if (fd >= 0)
+      ::close(fd);
+    fd = wd = -1;
+  }
+
+  /* Drains pending events; true if any was about the level file. Never blocks. */
+  bool changed ()
+  {
+    if (fd < 0)
+      return false;
+    bool hit = false;
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof buf)) > 0)
+      for (char *p = buf; p < buf + len; ) {
+        const struct inotify_event *ev = (const struct inotify_event*)p;
+        if (ev->len && name == ev->name)
+          hit = true;
+        p += sizeof(struct inotify_event) + ev->len;
+      }
+#endif
+    return hit;
+  }
+};
+
+#endif
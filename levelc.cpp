@@ -0,0 +1,60 @@
+/* Level compiler.
+ * Checks a level (text source or compiled) and writes it as the binary the
+ * game loads without parsing. The file is written next to the output and
+ * renamed over it, so a running game watching it never reads half a level.
+ * Without an output it prints the level as text source.
+ *
+ * Usage: ./levelc levels/default.level [levels/default.bin]
+ */
+#include "level.h"
+
+#include <cstdlib>
+
+void print_level (const Level &l)
+{
+  printf("mirrors 0\n");
+  for(int i = 0; i < l.mirrors; i++) {
+    const LevelMirror &m = level_mirrors(&l)[i];
+    printf("mirror %.9g %.9g %.9g %.9g %.6g\n", m.x1, m.y1, m.x2, m.y2, m.angle * 180 / M_PI);
+  }
+  printf("baskets %.9g %.9g\n", l.basket_start[0], l.basket_start[1]);
+  printf("basket_range %.9g %.9g %.9g %.9g\n", l.basket_min[0], l.basket_max[0], l.basket_min[1], l.basket_max[1]);
+  printf("basket_step %.9g\n", l.basket_step);
+  printf("water %.9g\n", l.water_line);
+  printf("spawn_x %.9g %.9g\n", l.spawn_xmin, l.spawn_xmax);
+  printf("gapy %.9g\n", l.gapy);
+  printf("cannon %.9g %.9g %.9g\n", l.cannon_min, l.cannon_max, l.cannon_step);
+  printf("turn %.6g %.9g\n", l.turn_limit * 180 / M_PI, l.turn_step);
+  printf("score %d %d %d %d\n", l.score_black_shot, l.score_other_shot, l.score_caught, l.score_black_water);
+}
+
+int main (int argc, char** argv)
+{
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s level [compiled]\n", argv[0]);
+    return 2;
+  }
+  LevelFile in;
+  if (!in.load(argv[1]))
+    return 1;
+  if (argc == 2) {
+    print_level(*in.level);
+    return 0;
+  }
+
+  std::string tmp = std::string(argv[2]) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  bool ok = f && fwrite(in.level, level_bytes(in.level), 1, f) == 1;
+  if (f && fclose(f) != 0)
+    ok = false;
+  if (!ok) {
+    fprintf(stderr, "Error: cannot write %s\n", tmp.c_str());
+    return 1;
+  }
+  if (rename(tmp.c_str(), argv[2]) != 0) {
+    fprintf(stderr, "Error: cannot replace %s\n", argv[2]);
+    return 1;
+  }
+  printf("%s: %d mirrors, %zu bytes\n", argv[2], in.level->mirrors, level_bytes(in.level));
+  return 0;
+}
@@ -0,0 +1,95 @@
+/* Headless GL 3.3 core context for the benchmark and replay tools.
+ * Uses EGL with Mesa's surfaceless platform (llvmpipe on GPU-less machines)
+ * and a pbuffer of the requested size, falling back to the default display. */
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+EGLDisplay offscreen_display = EGL_NO_DISPLAY;
+EGLSurface offscreen_surface = EGL_NO_SURFACE;
+EGLContext offscreen_context = EGL_NO_CONTEXT;
+EGLConfig offscreen_config;
+
+static void* offscreen_proc (const char* name)
+{
+  return (void*) eglGetProcAddress(name);
+}
+
+/* Resize the pbuffer, keeping the context. Callers set the viewport. */
+bool resizeOffscreen (int width, int height)
+{
+  const EGLint pbuffer_attribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+
+  if (offscreen_surface != EGL_NO_SURFACE) {
+    eglMakeCurrent(offscreen_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroySurface(offscreen_display, offscreen_surface);
+  }
+  offscreen_surface = eglCreatePbufferSurface(offscreen_display, offscreen_config, pbuffer_attribs);
+  if (offscreen_surface == EGL_NO_SURFACE)
+    return false;
+  if (!eglMakeCurrent(offscreen_display, offscreen_surface, offscreen_surface, offscreen_context))
+    return false;
+  // No vsync: frames are timed, not presented
+  eglSwapInterval(offscreen_display, 0);
+  return true;
+}
+
+bool initOffscreen (int width, int height)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay)
+    offscreen_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (offscreen_display == EGL_NO_DISPLAY)
+    offscreen_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  EGLint major, minor;
+  if (!eglInitialize(offscreen_display, &major, &minor)) {
+    fprintf(stderr, "Error: eglInitialize failed (0x%x)\n", eglGetError());
+    return false;
+  }
+
+  const EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_NONE
+  };
+  EGLint num_configs = 0;
+  if (!eglChooseConfig(offscreen_display, config_attribs, &offscreen_config, 1, &num_configs) || num_configs < 1) {
+    fprintf(stderr, "Error: no pbuffer-capable EGL config\n");
+    return false;
+  }
+
+  eglBindAPI(EGL_OPENGL_API);
+  const EGLint context_attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  offscreen_context = eglCreateContext(offscreen_display, offscreen_config, EGL_NO_CONTEXT, context_attribs);
+  if (offscreen_context == EGL_NO_CONTEXT) {
+    fprintf(stderr, "Error: eglCreateContext failed (0x%x)\n", eglGetError());
+    return false;
+  }
+
+  if (!resizeOffscreen(width, height)) {
+    fprintf(stderr, "Error: could not create %dx%d pbuffer\n", width, height);
+    return false;
+  }
+  return gladLoadGLLoader((GLADloadproc) offscreen_proc) != 0;
+}
+
+void quitOffscreen ()
+{
+  eglMakeCurrent(offscreen_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(offscreen_display, offscreen_context);
+  eglDestroySurface(offscreen_display, offscreen_surface);
+  eglTerminate(offscreen_display);
+}
+
+#endif
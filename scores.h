@@ -0,0 +1,312 @@
+/* Local store of finished games: an append-only binary log plus a top-N
+ * index.
+ *
+ * Every game is one fixed-size ScoreRecord appended to the log. submit()
+ * only queues it; a writer thread appends whatever is queued in one
+ * write() and fsyncs when sync_batch records are unsynced or sync_seconds
+ * have passed, so a game over never waits on the disk. After each sync
+ * the index (the best top_capacity games, and how much of the log it
+ * covers) is rewritten next to the log through a rename. Opening reads the
+ * index and scans only the log past it, so the leaderboard is ready at
+ * once however long the log has grown. A torn record at the end (a crash
+ * mid-write) is cut off on open.
+ *
+ * POSIX only.
+ */
+#ifndef SCORES_H
+#define SCORES_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct ScoreRecord {
+  char magic[4];         // "BSSR"
+  unsigned size;         // sizeof(ScoreRecord)
+  long long when;        // unix time at game over
+  float score, seconds;  // final score, simulated length
+  float avg_fall;        // mean block_trans over the game
+  float frame_p50_ms, frame_p95_ms;
+  int frames, hits, catches, misses;
+  unsigned seed;
+  unsigned checksum;     // of every byte before it
+};
+
+struct ScoreEntry {
+  float score, seconds;
+  long long when;
+  long long offset;      // of its record in the log
+};
+
+/* Rendered frame times in 0.25 ms buckets up to 64 ms, for percentiles
+   without keeping every sample. add() may race with percentile(). */
+struct FrameTimes {
+  static const int buckets = 256;
+  std::atomic<unsigned> count[buckets];
+
+  FrameTimes () { clear(); }
+
+  void clear ()
+  {
+    for (int k = 0; k < buckets; k++)
+      count[k] = 0;
+  }
+
+  void add (double ms)
+  {
+    count[std::min(buckets - 1, std::max(0, (int)(ms * 4)))]++;
+  }
+
+  /* Upper edge of the bucket holding the p-th fraction, 0 with no samples */
+  float percentile (double p) const
+  {
+    unsigned long total = 0, seen = 0;
+    for (int k = 0; k < buckets; k++)
+      total += count[k];
+    if (!total)
+      return 0;
+    for (int k = 0; k < buckets; k++)
+      if ((seen += count[k]) >= p * total)
+        return (k + 1) * 0.25f;
+    return buckets * 0.25f;
+  }
+};
+
+inline unsigned score_checksum (const ScoreRecord &r)
+{
+  const unsigned char *p = (const unsigned char*)&r;
+  unsigned h = 2166136261u;  // FNV-1a
+  for (size_t k = 0; k < offsetof(ScoreRecord, checksum); k++)
+    h = (h ^ p[k]) * 16777619u;
+  return h;
+}
+
+class ScoreStore {
+public:
+  static const int top_capacity = 100;
+  static const int sync_batch = 16;
+  static const int sync_seconds = 5;
+
+  ScoreStore () : fd(-1), log_end(0), stopping(false) {}
+  ~ScoreStore () { close(); }
+
+  bool is_open () const { return fd >= 0; }
+
+  /* Open (or create) the log, load the index and take in the log past it */
+  bool open (const char *path)
+  {
+    close();
+    log_path = path;
+    idx_path = log_path + ".idx";
+    fd = ::open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "Warning: cannot open score log %s\n", path);
+      return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    long long size = st.st_size - st.st_size % sizeof(ScoreRecord);
+    if (size != st.st_size && ftruncate(fd, size) != 0)
+      fprintf(stderr, "Warning: cannot cut the torn end of %s\n", path);
+    long long from = load_index(size);
+    ScoreRecord r;
+    for (long long off = from; off < size; off += sizeof r)
+      if (pread(fd, &r, sizeof r, off) == (ssize_t)sizeof r && valid(r))
+        insert(best, r, off);
+    log_end = size;
+    stopping = false;
+    writer = std::thread(&ScoreStore::run, this, best, log_end);
+    return true;
+  }
+
+  /* Queue a finished game; returns its place on the leaderboard (0 is
+     best) or -1 if it did not make it. Never touches the disk. */
+  int submit (ScoreRecord r)
+  {
+    memcpy(r.magic, "BSSR", 4);
+    r.size = sizeof r;
+    r.checksum = score_checksum(r);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd < 0)
+      return -1;
+    queue.push_back(r);
+    int rank = insert(best, r, log_end);
+    log_end += sizeof r;
+    wake.notify_one();
+    return rank;
+  }
+
+  /* The best n games so far, best first */
+  std::vector<ScoreEntry> top (int n)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::vector<ScoreEntry>(best.begin(), best.begin() + std::min(n, (int)best.size()));
+  }
+
+  /* Write and sync everything queued, save the index and stop the writer */
+  void close ()
+  {
+    if (writer.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_one();
+      writer.join();
+    }
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+    best.clear();
+  }
+
+private:
+  struct IndexHeader {
+    char magic[8];       // "BSSIDX1"
+    unsigned record_size;
+    int entries;
+    long long covers;    // log bytes the entries were taken from
+  };
+
+  int fd;
+  std::string log_path, idx_path;
+  long long log_end;              // after the queued records
+  std::vector<ScoreEntry> best;   // sorted, best first, queued records included
+  std::vector<ScoreRecord> queue;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping;
+  std::thread writer;
+
+  static bool valid (const ScoreRecord &r)
+  {
+    return !memcmp(r.magic, "BSSR", 4) && r.size == sizeof r && r.checksum == score_checksum(r);
+  }
+
+  /* Sorted insert; returns the place or -1 */
+  static int insert (std::vector<ScoreEntry> &best, const ScoreRecord &r, long long offset)
+  {
+    ScoreEntry e = { r.score, r.seconds, r.when, offset };
+    int k = best.size();
+    while (k > 0 && best[k-1].score < e.score)
+      k--;
+    if (k >= top_capacity)
+      return -1;
+    best.insert(best.begin() + k, e);
+    if ((int)best.size() > top_capacity)
+      best.pop_back();
+    return k;
+  }
+
+  /* Entries from the index; returns the log offset it covers up to (0 to
+     scan the whole log if the index is missing, stale or from elsewhere) */
+  long long load_index (long long log_size)
+  {
+    best.clear();
+    FILE *f = fopen(idx_path.c_str(), "rb");
+    if (!f)
+      return 0;
+    IndexHeader H;
+    bool ok = fread(&H, sizeof H, 1, f) == 1 && !memcmp(H.magic, "BSSIDX1", 8)
+           && H.record_size == sizeof(ScoreRecord) && H.entries >= 0 && H.entries <= top_capacity
+           && H.covers <= log_size && H.covers % sizeof(ScoreRecord) == 0;
+    if (ok) {
+      best.resize(H.entries);
+      ok = !H.entries || fread(&best[0], sizeof(ScoreEntry), H.entries, f) == (size_t)H.entries;
+    }
+    fclose(f);
+    if (!ok) {
+      best.clear();
+      return 0;
+    }
+    return H.covers;
+  }
+
+  void save_index (const std::vector<ScoreEntry> &entries, long long covers)
+  {
+    IndexHeader H;
+    memset(&H, 0, sizeof H);
+    memcpy(H.magic, "BSSIDX1", 8);
+    H.record_size = sizeof(ScoreRecord);
+    H.entries = entries.size();
+    H.covers = covers;
+    std::string tmp = idx_path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    bool ok = f && fwrite(&H, sizeof H, 1, f) == 1
+           && (entries.empty() || fwrite(&entries[0], sizeof(ScoreEntry), entries.size(), f) == entries.size())
+           && fflush(f) == 0 && fsync(fileno(f)) == 0;  // on disk before the rename points at it
+    if (f && fclose(f) != 0)
+      ok = false;
+    if (!ok || rename(tmp.c_str(), idx_path.c_str()) != 0)
+      fprintf(stderr, "Warning: cannot write score index %s\n", idx_path.c_str());
+  }
+
+  /* Writer thread: append in batches, sync by count or age. It keeps its
+     own leaderboard of what is on disk (from the log as opened), which is
+     what the index gets; a batch counts as on disk only once all of it was
+     written. A failed or short write is cut back off the log, so records
+     stay aligned, and the batch is tried again with the next game (one
+     still failing at close() is dropped). */
+  void run (std::vector<ScoreEntry> disk_best, long long disk_end)
+  {
+    std::vector<ScoreRecord> batch;
+    int unsynced = 0;
+    std::chrono::steady_clock::time_point first_unsynced;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      if (queue.empty() && !stopping) {
+        if (unsynced)
+          wake.wait_until(lock, first_unsynced + std::chrono::seconds(sync_seconds));
+        else
+          wake.wait(lock);
+      }
+      batch.insert(batch.end(), queue.begin(), queue.end());  // after any that failed
+      queue.clear();
+      bool stop = stopping;
+      lock.unlock();
+
+      if (!batch.empty()) {
+        size_t bytes = batch.size() * sizeof(ScoreRecord);
+        if (write(fd, &batch[0], bytes) != (ssize_t)bytes) {
+          fprintf(stderr, "Warning: cannot append to score log %s\n", log_path.c_str());
+          if (ftruncate(fd, disk_end) != 0)
+            fprintf(stderr, "Warning: cannot cut the torn end of %s\n", log_path.c_str());
+        }
+        else {
+          if (!unsynced)
+            first_unsynced = std::chrono::steady_clock::now();
+          for (size_t k = 0; k < batch.size(); k++, disk_end += sizeof(ScoreRecord))
+            insert(disk_best, batch[k], disk_end);
+          unsynced += batch.size();
+          batch.clear();
+        }
+      }
+      if (unsynced && (stop || unsynced >= sync_batch
+                       || std::chrono::steady_clock::now() >= first_unsynced + std::chrono::seconds(sync_seconds))) {
+        fsync(fd);
+        unsynced = 0;
+        save_index(disk_best, disk_end);
+      }
+
+      lock.lock();
+      if (stop && queue.empty() && !unsynced)
+        return;
+    }
+  }
+
+  ScoreStore (const ScoreStore&);
+  ScoreStore& operator= (const ScoreStore&);
+};
+
+#endif
@@ -0,0 +1,170 @@
+/* Static bounding-volume hierarchy over 2D segments (mirrors, walls).
+ * Built once when a level loads: boxes split at the median centroid along
+ * their longer side, down to leaves of at most leaf_size segments, stored
+ * as one flat array with both children of a node next to each other.
+ * nearest() walks it front to back and skips every box farther than the
+ * best hit so far, so a ray costs about log(n) box tests instead of n
+ * segment tests.
+ *
+ * Rays are P + t*D for t in (0, tmax); segments are hit anywhere on them,
+ * vertical and horizontal ones included. A ray parallel to a segment does
+ * not hit it.
+ */
+#ifndef SEGMENT_BVH_H
+#define SEGMENT_BVH_H
+
+#include <algorithm>
+#include <vector>
+
+class SegmentBVH {
+  struct Node {
+    float minx, miny, maxx, maxy;
+    int first;   // leaf: first segment; inner: left child (right is first + 1)
+    int count;   // segments in a leaf, 0 for an inner node
+  };
+
+  static const int leaf_size = 4;
+
+  std::vector<Node> nodes;
+  std::vector<float> sx1, sy1, sx2, sy2;  // segments in tree order
+  std::vector<int> ids;                   // caller's index of each
+
+  /* Segment centroids, only while building */
+  std::vector<float> cx, cy;
+
+  void bound (Node &N, int begin, int end) const
+  {
+    N.minx = N.miny = 1e30f, N.maxx = N.maxy = -1e30f;
+    for(int k = begin; k < end; k++) {
+      N.minx = std::min(N.minx, std::min(sx1[k], sx2[k]));
+      N.maxx = std::max(N.maxx, std::max(sx1[k], sx2[k]));
+      N.miny = std::min(N.miny, std::min(sy1[k], sy2[k]));
+      N.maxy = std::max(N.maxy, std::max(sy1[k], sy2[k]));
+    }
+  }
+
+  void swap_segments (int a, int b)
+  {
+    std::swap(sx1[a], sx1[b]), std::swap(sy1[a], sy1[b]);
+    std::swap(sx2[a], sx2[b]), std::swap(sy2[a], sy2[b]);
+    std::swap(cx[a], cx[b]), std::swap(cy[a], cy[b]);
+    std::swap(ids[a], ids[b]);
+  }
+
+  /* Quickselect: the median by centroid on 'axis' ends at 'mid' */
+  void partition (int begin, int end, int mid, bool axis)
+  {
+    std::vector<float> &c = axis ? cy : cx;
+    while (end - begin > 1) {
+      float pivot = c[(begin + end) / 2];
+      int i = begin, j = end - 1;
+      while (i <= j) {
+        while (c[i] < pivot) i++;
+        while (c[j] > pivot) j--;
+        if (i <= j)
+          swap_segments(i++, j--);
+      }
+      if (mid <= j) end = j + 1;
+      else if (mid >= i) begin = i;
+      else return;
+    }
+  }
+
+  void split (int node, int begin, int end)
+  {
+    bound(nodes[node], begin, end);
+    if (end - begin <= leaf_size) {
+      nodes[node].first = begin;
+      nodes[node].count = end - begin;
+      return;
+    }
+    const Node &N = nodes[node];
+    int mid = (begin + end) / 2;
+    partition(begin, end, mid, N.maxy - N.miny > N.maxx - N.minx);
+    int left = nodes.size();
+    nodes[node].first = left;
+    nodes[node].count = 0;
+    nodes.resize(left + 2);
+    split(left, begin, mid);
+    split(left + 1, mid, end);
+  }
+
+  /* Entry t of the ray into the box, or a value > tmax if it misses */
+  static float enter (const Node &N, float ox, float oy, float ix, float iy, float tmax)
+  {
+    float tx1 = (N.minx - ox) * ix, tx2 = (N.maxx - ox) * ix;
+    float ty1 = (N.miny - oy) * iy, ty2 = (N.maxy - oy) * iy;
+    float t0 = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), 0.0f);
+    float t1 = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), tmax);
+    return t0 <= t1 ? t0 : tmax * 2 + 1;
+  }
+
+public:
+  /* Any type with x1, y1, x2, y2 members */
+  template <class S>
+  void build (const S *segs, int n)
+  {
+    nodes.clear();
+    sx1.resize(n), sy1.resize(n), sx2.resize(n), sy2.resize(n);
+    ids.resize(n), cx.resize(n), cy.resize(n);
+    for(int k = 0; k < n; k++) {
+      sx1[k] = segs[k].x1, sy1[k] = segs[k].y1, sx2[k] = segs[k].x2, sy2[k] = segs[k].y2;
+      cx[k] = (sx1[k] + sx2[k]) / 2, cy[k] = (sy1[k] + sy2[k]) / 2;
+      ids[k] = k;
+    }
+    if (n) {
+      nodes.resize(1);
+      split(0, 0, n);
+    }
+    cx.clear(), cy.clear();
+  }
+
+  int size () const { return ids.size(); }
+
+  /* Nearest segment the ray (ox, oy) + t*(dx, dy), 0 < t < tmax, hits,
+     ignoring the 'nskip' indices in 'skip'. Returns its index and sets t,
+     or returns -1. */
+  int nearest (float ox, float oy, float dx, float dy, float tmax,
+               const int *skip, int nskip, float &t) const
+  {
+    if (nodes.empty())
+      return -1;
+    const float ix = dx != 0 ? 1 / dx : 1e30f, iy = dy != 0 ? 1 / dy : 1e30f;
+    int best = -1;
+    float best_t = tmax;
+    int stack[64], top = 0;
+    stack[top++] = 0;
+    while (top) {
+      const Node &N = nodes[stack[--top]];
+      if (enter(N, ox, oy, ix, iy, best_t) > best_t)
+        continue;
+      if (N.count == 0) {
+        // Nearer child last so it is taken first
+        float tl = enter(nodes[N.first], ox, oy, ix, iy, best_t);
+        float tr = enter(nodes[N.first + 1], ox, oy, ix, iy, best_t);
+        if (tl <= tr) stack[top++] = N.first + 1, stack[top++] = N.first;
+        else stack[top++] = N.first, stack[top++] = N.first + 1;
+        continue;
+      }
+      for(int k = N.first; k < N.first + N.count; k++) {
+        float ex = sx2[k] - sx1[k], ey = sy2[k] - sy1[k];
+        float denom = dx * ey - dy * ex;
+        if (denom == 0)
+          continue;
+        float wx = sx1[k] - ox, wy = sy1[k] - oy;
+        float s = (wx * ey - wy * ex) / denom;   // along the ray
+        float u = (wx * dy - wy * dx) / denom;   // along the segment
+        if (s <= 0 || s >= best_t || u < 0 || u > 1)
+          continue;
+        if (std::find(skip, skip + nskip, ids[k]) != skip + nskip)
+          continue;
+        best = ids[k], best_t = s;
+      }
+    }
+    if (best >= 0)
+      t = best_t;
+    return best;
+  }
+};
+
+#endif
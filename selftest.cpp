@@ -0,0 +1,201 @@
+/* Self-test of the simulation, no window or GL context needed.
+ *
+ *   record/replay   a scripted game (keys, mouse aim and drags, wheel) is
+ *                   recorded through sim_step() as --record does, the
+ *                   session file is replayed, and the score and block
+ *                   pool must match on every tick
+ *   stress, waves   the same with a level file and stress mode, and with a
+ *                   wave script, which the replay must take from the
+ *                   session
+ *   savestate       a savestate with a block colour outside 0 to 2, or a
+ *                   non-finite block, cannon or battery number, is refused
+ *                   and leaves the game as it was
+ *
+ * Exits 1 if any check fails. Run from the source directory (make test):
+ * it reads levels/ and waves/.
+ *
+ * Usage: ./selftest
+ */
+#define SAMPLE2D_NO_MAIN
+#include "Sample_GL3_2D.cpp"
+
+#include <cstddef>
+#include <unistd.h>
+
+int failures = 0;
+
+void check (bool ok, const char *what)
+{
+  printf("%-14s %s\n", what, ok ? "ok" : "FAILED");
+  failures += !ok;
+}
+
+/* Score and live blocks after one tick */
+struct TickState {
+  float score;
+  int blocks;
+  unsigned digest;
+};
+
+TickState tick_state ()
+{
+  TickState t = { Score, pool.size(), 2166136261u };
+  for(int n = 0; n < pool.size(); n++) {
+    const unsigned char *b = (const unsigned char*)&pool.cur[pool.live[n]];
+    for(size_t i = 0; i < sizeof(Piece); i++)
+      t.digest = (t.digest ^ b[i]) * 16777619u;
+  }
+  return t;
+}
+
+/* Hold keys in stretches that change every few ticks: moves, aims and
+   fires both cannons and pans, zooms and slides the baskets */
+void script_keys (int tick)
+{
+  static const int keys[] = {
+    GLFW_KEY_SPACE, GLFW_KEY_A, GLFW_KEY_D, GLFW_KEY_ENTER, GLFW_KEY_I, GLFW_KEY_K,
+    GLFW_KEY_J, GLFW_KEY_L, GLFW_KEY_S, GLFW_KEY_F, GLFW_KEY_LEFT, GLFW_KEY_UP, GLFW_KEY_N
+  };
+  for(int n = 0; n < (int)(sizeof keys / sizeof *keys); n++)
+    key_down[keys[n]] = ((tick / (3 + n)) * 2654435761u >> (n + 7)) & 1;
+}
+
+/* Every 120 ticks: press in the play area and drift while held, so cannon
+   0 aims and fires at the cursor, then grab cannon 0 by its base and drag
+   it. The wheel turns now and then. */
+void script_mouse (int tick)
+{
+  int phase = tick % 120;
+  if (phase == 0) {
+    cursor_x = 150 + (tick * 37) % 400, cursor_y = 80 + (tick * 53) % 400;
+    button_down = click_pending = true;
+  }
+  else if (phase == 60) {
+    cursor_x = 15, cursor_y = (40 - c) * 600 / 80;
+    button_down = click_pending = true;
+  }
+  else if (phase == 12 || phase == 72)
+    button_down = false;
+  else if (phase < 12 || (phase > 60 && phase < 72))
+    cursor_y = cursor_y + 4;
+  if (tick % 25 == 0)
+    scroll_steps += tick % 50 ? 1 : -1;
+}
+
+/* Record with the given level file, wave script and stress block count
+   (NULL, NULL, 0: none), and put the defaults back before the replay */
+bool record_replay (const char *level_file, const char *waves_file, int stress)
+{
+  char path[] = "/tmp/selftest.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return false;
+  close(fd);
+
+  const int ticks = 600;
+  vector<TickState> recorded;
+  RenderSnapshot S;
+  game_seed = 6;
+  num_cannons = 2;
+  level_path = level_file;
+  waves_path = waves_file;
+  stress_mode = stress > 0;
+  num_blocks = stress_mode ? stress : 20;
+  if ((level_path && !load_level(level_path)) || (waves_path && !load_waves(waves_path)))
+    return false;
+  createMirrorGeometry();  // initGL's part that the simulation needs
+  clear_input();
+  reset_game();
+  if (!start_recording(path, NULL))
+    return false;
+  for(int t = 0; t < ticks; t++) {
+    if (sim_step(S))
+      break;
+    recorded.push_back(tick_state());
+    script_keys(t);  // the callbacks, between ticks
+    script_mouse(t);
+  }
+  stop_recording();
+  level = builtin_level();
+  level_path = waves_path = NULL;
+  wave_script.clear();
+  stress_mode = false;
+  num_blocks = 20;
+
+  Session s;
+  bool ok = load_session(path, s) && begin_replay(s) && s.frames == (int)recorded.size();
+  size_t next = 0;
+  for(int t = 0; ok && t < s.frames; t++) {
+    replay_input(s, next, t);
+    if (sim_step(S))
+      ok = false;
+    TickState r = tick_state();
+    if (r.score != recorded[t].score || r.blocks != recorded[t].blocks || r.digest != recorded[t].digest) {
+      fprintf(stderr, "record/replay: tick %d: score %g, %d blocks; recorded %g, %d blocks\n",
+              t, r.score, r.blocks, recorded[t].score, recorded[t].blocks);
+      ok = false;
+    }
+  }
+  unlink(path);
+  return ok;
+}
+
+/* Copy of blob with the value put at byte offset 'at' */
+template <class T>
+vector<char> patched (const vector<char> &blob, size_t at, T value)
+{
+  vector<char> b = blob;
+  memcpy(&b[at], &value, sizeof value);
+  return b;
+}
+
+bool savestate_checks ()
+{
+  RenderSnapshot S;
+  game_seed = 1;
+  num_cannons = 2;
+  clear_input();
+  reset_game();
+  for(int t = 0; t < 30; t++)
+    sim_step(S);
+  vector<char> blob;
+  save_state(blob);
+  if (pool.size() == 0 || !load_state(&blob[0], blob.size()))
+    return false;
+  TickState before = tick_state();
+
+  SaveHeader H;
+  memcpy(&H, &blob[0], sizeof H);
+  const size_t piece = sizeof H + pool.live[0]*sizeof(Piece);
+  const size_t cannon = blob.size() - H.cannons*sizeof(Cannon) + sizeof(Cannon);  // cannon 1
+  const size_t battery = cannon + offsetof(Cannon, battery);
+  vector<vector<char> > bad;
+  const float colors[] = { 7, -1, 1.5f, NAN, 1e9f };
+  for(int n = 0; n < (int)(sizeof colors / sizeof *colors); n++)
+    bad.push_back(patched(blob, piece + offsetof(Piece, color), colors[n]));
+  bad.push_back(patched(blob, piece + offsetof(Piece, y2), INFINITY));
+  bad.push_back(patched(blob, cannon + offsetof(Cannon, y), NAN));
+  bad.push_back(patched(blob, cannon + offsetof(Cannon, rot), -INFINITY));
+  bad.push_back(patched(blob, battery + offsetof(Battery, t0), (double)NAN));
+  bad.push_back(patched(blob, battery + offsetof(Battery, e0), NAN));
+  bad.push_back(patched(blob, battery + offsetof(Battery, rate), INFINITY));
+  bad.push_back(patched(blob, battery + offsetof(Battery, next), (double)NAN));
+  bad.push_back(patched(blob, battery + offsetof(Battery, shown), battery_levels + 1));
+  bool ok = true;
+  for(int n = 0; n < (int)bad.size(); n++)
+    if (load_state(&bad[n][0], bad[n].size())) {
+      fprintf(stderr, "savestate: corrupt blob %d was loaded\n", n);
+      ok = false;
+    }
+  TickState after = tick_state();
+  return ok && after.score == before.score && after.blocks == before.blocks && after.digest == before.digest;
+}
+
+int main ()
+{
+  check(record_replay(NULL, NULL, 0), "record/replay");
+  check(record_replay("levels/default.level", NULL, 300), "stress");
+  check(record_replay(NULL, "waves/example.waves", 0), "waves");
+  check(savestate_checks(), "savestate");
+  return failures ? 1 : 0;
+}